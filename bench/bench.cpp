@@ -0,0 +1,937 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#include "socket.hpp"
+#include "tcp.hpp"
+#include "udp.hpp"
+#include "unix.hpp"
+#include "common.hpp"
+#include "ssl.hpp"
+#include "shm.hpp"
+#include "utils.hpp"
+#include "pool.hpp"
+#include "handshake.hpp"
+#include "histogram.hpp"
+#include "tests/tls.hpp"
+
+namespace bench {
+    using clock = std::chrono::steady_clock;
+    using histogram = libsocket::histogram;
+
+    struct config {
+        std::set<std::string> suites = {"tcp", "udp", "unix", "tls", "shm", "gso", "pool"};
+
+        int32_t threads = 1;
+        int64_t size = 64;
+        int64_t iterations = 10000;
+        int64_t duration_ms = 1000;
+        int64_t connections = 2000;
+        int32_t spin_us = 0;
+        int32_t work_us = 20;
+
+        std::string output;
+    };
+
+    uint64_t elapsed_ns(clock::time_point since) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - since).count();
+    }
+
+    double per_second(uint64_t count, uint64_t ns) {
+        return ns ? count * 1e9 / ns : 0;
+    }
+
+    class report {
+        std::vector<std::string> __results;
+    public:
+        using fields = std::vector<std::pair<std::string, std::string>>;
+
+        static std::string number(double value) {
+            std::ostringstream out;
+            out.precision(15);
+            out << value;
+
+            return out.str();
+        }
+
+        static std::string quote(std::string value) {
+            return "\"" + value + "\"";
+        }
+
+        static fields latency(const histogram& hist) {
+            return {
+                {"samples", number(hist.count())},
+                {"min_ns", number(hist.min())},
+                {"mean_ns", number(hist.mean())},
+                {"p50_ns", number(hist.percentile(50))},
+                {"p99_ns", number(hist.percentile(99))},
+                {"p999_ns", number(hist.percentile(99.9))},
+                {"max_ns", number(hist.max())}
+            };
+        }
+
+        void add(std::string name, std::string transport, const config& cfg, fields values) {
+            std::string json = "{\"name\": " + quote(name) + ", \"transport\": " + quote(transport) +
+                ", \"threads\": " + number(cfg.threads) + ", \"size\": " + number(cfg.size);
+
+            for (auto& [key, value] : values) json += ", " + quote(key) + ": " + value;
+
+            __results.push_back(json + "}");
+        }
+
+        void print(std::ostream& out, const config& cfg) {
+            std::string suites;
+
+            for (const std::string& suite : cfg.suites) suites += (suites.empty() ? "" : ", ") + quote(suite);
+
+            out << "{\n  \"benchmark\": \"libsocket\",\n  \"config\": {\"suites\": [" << suites << "]"
+                << ", \"threads\": " << cfg.threads << ", \"size\": " << cfg.size
+                << ", \"iterations\": " << cfg.iterations << ", \"duration_ms\": " << cfg.duration_ms
+                << ", \"connections\": " << cfg.connections << ", \"spin_us\": " << cfg.spin_us << ", \"work_us\": " << cfg.work_us << "},\n  \"results\": [";
+
+            for (size_t i = 0; i < __results.size(); i++) out << (i ? ",\n    " : "\n    ") << __results[i];
+
+            out << "\n  ]\n}" << std::endl;
+        }
+    };
+
+    // Peers run in forked processes so that the client side is the only user of its
+    // socket table; each process serves one connection at a time (pre-fork model).
+    class server {
+        std::vector<pid_t> __pids;
+    public:
+        server(int32_t procs, std::function<void()> body) {
+            for (int32_t i = 0; i < procs; i++) {
+                pid_t pid = fork();
+
+                if (pid == -1) throw std::runtime_error("fork(): " + std::string(strerror(errno)));
+
+                if (pid == 0) {
+                    while (true) {
+                        try { body(); }
+                        catch (const std::exception&) {}
+                    }
+                }
+
+                __pids.push_back(pid);
+            }
+        }
+
+        ~server() {
+            for (pid_t pid : __pids) kill(pid, SIGKILL);
+            for (pid_t pid : __pids) waitpid(pid, nullptr, 0);
+        }
+    };
+
+    void run_threads(int32_t count, std::function<void(int32_t)> body) {
+        std::vector<std::thread> threads;
+
+        for (int32_t i = 0; i < count; i++) threads.emplace_back([&body, i] {
+            try { body(i); }
+            catch (const std::exception& e) { std::cerr << "thread " << i << ": " << e.what() << std::endl; }
+        });
+
+        for (std::thread& thread : threads) thread.join();
+    }
+
+    enum class layer {
+        plain,
+        tls,
+        shm
+    };
+
+    struct transport {
+        std::string name;
+        std::function<libsocket::descriptor()> open;
+        libsocket::address addr;
+        layer over = layer::plain;
+    };
+
+    using tls_state = fixture::tls_state;
+    using fixture::make_tls;
+
+    std::vector<int8_t> read_some(libsocket::descriptor desc, int64_t size, const transport& tr) {
+        if (tr.over == layer::tls) return libsocket::ssl::read(desc, size);
+        if (tr.over == layer::shm) return libsocket::shm::read(desc, size);
+
+        return libsocket::read(desc, size);
+    }
+
+    int64_t write_some(libsocket::descriptor desc, const std::vector<int8_t>& buffer, const transport& tr) {
+        if (tr.over == layer::tls) return libsocket::ssl::write(desc, buffer);
+        if (tr.over == layer::shm) return libsocket::shm::write(desc, buffer);
+
+        return libsocket::write(desc, buffer);
+    }
+
+    int64_t send_all(libsocket::descriptor desc, const std::vector<int8_t>& buffer, const transport& tr) {
+        int64_t sent = 0;
+
+        while (sent < static_cast<int64_t>(buffer.size())) {
+            std::vector<int8_t> chunk(buffer.begin() + sent, buffer.end());
+            int64_t n = write_some(desc, chunk, tr);
+
+            if (n <= 0) return sent;
+
+            sent += n;
+        }
+
+        return sent;
+    }
+
+    int64_t recv_exact(libsocket::descriptor desc, int64_t size, const transport& tr) {
+        int64_t received = 0;
+
+        while (received < size) {
+            std::vector<int8_t> chunk = read_some(desc, size - received, tr);
+
+            if (chunk.empty()) return received;
+
+            received += chunk.size();
+        }
+
+        return received;
+    }
+
+    libsocket::descriptor server_accept(libsocket::descriptor listener, transport& tr, tls_state& tls) {
+        libsocket::descriptor client = libsocket::accept(listener);
+
+        if (tr.over == layer::tls) {
+            libsocket::ssl::enable(client, tls.server_ctx);
+            libsocket::ssl::handshake(client);
+        }
+
+        if (tr.over == layer::shm) libsocket::shm::accept(client);
+
+        return client;
+    }
+
+    void server_close(libsocket::descriptor client, transport& tr) {
+        if (tr.over == layer::tls) libsocket::ssl::shutdown(client);
+        if (tr.over == layer::shm) libsocket::shm::shutdown(client);
+
+        libsocket::close(client);
+    }
+
+    libsocket::descriptor client_connect(transport& tr, tls_state& tls) {
+        libsocket::descriptor desc = tr.open();
+        libsocket::connect(desc, tr.addr);
+
+        if (tr.over == layer::tls) {
+            libsocket::ssl::enable(desc, tls.client_ctx);
+            libsocket::ssl::handshake(desc);
+        }
+
+        if (tr.over == layer::shm) libsocket::shm::offer(desc);
+
+        return desc;
+    }
+
+    libsocket::descriptor listen_on(transport& tr) {
+        libsocket::descriptor listener = tr.open();
+
+        if (tr.addr.family() == AF_UNIX) libsocket::unix::unlink(tr.addr.string());
+
+        libsocket::bind(listener, tr.addr);
+        libsocket::listen(listener, 1024);
+
+        if (tr.addr.family() != AF_UNIX) tr.addr = libsocket::utils::getsockname(listener);
+
+        return listener;
+    }
+
+    // Spin-mode results carry the spin counters of the client side and the p99 delta
+    // against the preceding baseline run.
+    report::fields spin_fields(int32_t spin_us, uint64_t p99, uint64_t baseline_p99, libsocket::stats::snapshot_t before) {
+        libsocket::stats::snapshot_t after = libsocket::stats::snapshot();
+
+        return {
+            {"spin_us", report::number(spin_us)},
+            {"spin_hits", report::number(after.spin_hits - before.spin_hits)},
+            {"spin_misses", report::number(after.spin_misses - before.spin_misses)},
+            {"p99_improvement_ns", report::number(static_cast<double>(baseline_p99) - static_cast<double>(p99))}
+        };
+    }
+
+    uint64_t stream_pingpong(report& rep, const config& cfg, transport tr, tls_state& tls, int32_t spin_us = 0, uint64_t baseline_p99 = 0) {
+        libsocket::descriptor listener = listen_on(tr);
+        libsocket::stats::snapshot_t before = libsocket::stats::snapshot();
+        uint64_t p99 = 0;
+
+        {
+            server peer(cfg.threads, [&] {
+                libsocket::descriptor client = server_accept(listener, tr, tls);
+
+                if (spin_us) libsocket::busy_poll(client, spin_us);
+
+                while (true) {
+                    std::vector<int8_t> buffer = read_some(client, cfg.size, tr);
+
+                    if (buffer.empty() || send_all(client, buffer, tr) != static_cast<int64_t>(buffer.size())) break;
+                }
+
+                server_close(client, tr);
+            });
+
+            std::vector<histogram> hists(cfg.threads);
+
+            run_threads(cfg.threads, [&](int32_t idx) {
+                libsocket::descriptor desc = client_connect(tr, tls);
+                std::vector<int8_t> message(cfg.size, 'x');
+
+                if (spin_us) libsocket::busy_poll(desc, spin_us);
+
+                for (int64_t i = 0; i < cfg.iterations; i++) {
+                    clock::time_point start = clock::now();
+
+                    if (send_all(desc, message, tr) != cfg.size || recv_exact(desc, cfg.size, tr) != cfg.size) break;
+
+                    hists[idx].record(elapsed_ns(start));
+                }
+
+                server_close(desc, tr);
+            });
+
+            histogram total;
+
+            for (histogram& hist : hists) total.merge(hist);
+
+            report::fields fields = report::latency(total);
+            p99 = total.percentile(99);
+
+            if (spin_us) {
+                report::fields spin = spin_fields(spin_us, p99, baseline_p99, before);
+                fields.insert(fields.end(), spin.begin(), spin.end());
+            }
+
+            rep.add(tr.name + (spin_us ? ".pingpong_spin" : ".pingpong"), tr.name, cfg, fields);
+        }
+
+        libsocket::close(listener);
+
+        return p99;
+    }
+
+    void stream_throughput(report& rep, const config& cfg, transport tr, tls_state& tls) {
+        libsocket::descriptor listener = listen_on(tr);
+
+        {
+            server peer(cfg.threads, [&] {
+                libsocket::descriptor client = server_accept(listener, tr, tls);
+
+                while (!read_some(client, 1 << 16, tr).empty());
+
+                server_close(client, tr);
+            });
+
+            std::vector<uint64_t> bytes(cfg.threads, 0);
+            clock::time_point start = clock::now();
+
+            run_threads(cfg.threads, [&](int32_t idx) {
+                libsocket::descriptor desc = client_connect(tr, tls);
+                std::vector<int8_t> message(cfg.size, 'x');
+                clock::time_point deadline = clock::now() + std::chrono::milliseconds(cfg.duration_ms);
+
+                while (clock::now() < deadline) {
+                    int64_t n = send_all(desc, message, tr);
+
+                    if (n <= 0) break;
+
+                    bytes[idx] += n;
+                }
+
+                server_close(desc, tr);
+            });
+
+            uint64_t ns = elapsed_ns(start);
+            uint64_t total = 0;
+
+            for (uint64_t count : bytes) total += count;
+
+            rep.add(tr.name + ".throughput", tr.name, cfg, {
+                {"bytes", report::number(total)},
+                {"elapsed_ns", report::number(ns)},
+                {"bytes_per_sec", report::number(per_second(total, ns))}
+            });
+        }
+
+        libsocket::close(listener);
+    }
+
+    void stream_accept(report& rep, const config& cfg, transport tr, tls_state& tls) {
+        libsocket::descriptor listener = listen_on(tr);
+
+        {
+            server peer(cfg.threads, [&] {
+                libsocket::descriptor client = server_accept(listener, tr, tls);
+
+                server_close(client, tr);
+            });
+
+            int64_t per_thread = std::max<int64_t>(1, cfg.connections / cfg.threads);
+            std::vector<histogram> hists(cfg.threads);
+            clock::time_point start = clock::now();
+
+            run_threads(cfg.threads, [&](int32_t idx) {
+                for (int64_t i = 0; i < per_thread; i++) {
+                    clock::time_point begin = clock::now();
+                    libsocket::descriptor desc = client_connect(tr, tls);
+
+                    hists[idx].record(elapsed_ns(begin));
+
+                    server_close(desc, tr);
+                }
+            });
+
+            uint64_t ns = elapsed_ns(start);
+            histogram total;
+
+            for (histogram& hist : hists) total.merge(hist);
+
+            report::fields fields = report::latency(total);
+            fields.push_back({"elapsed_ns", report::number(ns)});
+            fields.push_back({"per_sec", report::number(per_second(total.count(), ns))});
+
+            rep.add(tr.name + (tr.over == layer::tls ? ".handshake" : ".accept"), tr.name, cfg, fields);
+        }
+
+        libsocket::close(listener);
+    }
+
+    void set_timeout(libsocket::descriptor desc, int64_t ms) {
+        timeval tv{ms / 1000, (ms % 1000) * 1000};
+
+        libsocket::utils::setsockopt(desc, SOL_SOCKET, SO_RCVTIMEO, tv);
+    }
+
+    libsocket::descriptor udp_server_socket(libsocket::address& addr) {
+        libsocket::descriptor sock = libsocket::ipv4::udp::socket();
+        libsocket::utils::setsockopt(sock, SOL_SOCKET, SO_RCVBUF, int32_t(8 << 20));
+        libsocket::bind(sock, libsocket::address(127, 0, 0, 1, 0));
+
+        addr = libsocket::utils::getsockname(sock);
+
+        return sock;
+    }
+
+    uint64_t udp_pingpong(report& rep, const config& cfg, int32_t spin_us = 0, uint64_t baseline_p99 = 0) {
+        libsocket::address addr;
+        libsocket::descriptor sock = udp_server_socket(addr);
+        libsocket::stats::snapshot_t before = libsocket::stats::snapshot();
+        uint64_t p99 = 0;
+
+        if (spin_us) libsocket::busy_poll(sock, spin_us);
+
+        {
+            server peer(1, [&] {
+                libsocket::datagram dgram = libsocket::readfrom(sock, 1 << 16);
+
+                libsocket::writeto(sock, dgram.data, dgram.addr);
+            });
+
+            std::vector<histogram> hists(cfg.threads);
+            std::vector<uint64_t> lost(cfg.threads, 0);
+
+            run_threads(cfg.threads, [&](int32_t idx) {
+                libsocket::descriptor desc = libsocket::ipv4::udp::socket();
+                std::vector<int8_t> message(cfg.size, 'x');
+
+                set_timeout(desc, 200);
+
+                if (spin_us) libsocket::busy_poll(desc, spin_us);
+
+                for (int64_t i = 0; i < cfg.iterations; i++) {
+                    clock::time_point start = clock::now();
+
+                    try {
+                        libsocket::writeto(desc, message, addr);
+
+                        if (libsocket::readfrom(desc, cfg.size).data.size() != static_cast<size_t>(cfg.size)) throw std::runtime_error("short datagram");
+                    }
+
+                    catch (const std::exception&) {
+                        lost[idx]++;
+                        continue;
+                    }
+
+                    hists[idx].record(elapsed_ns(start));
+                }
+
+                libsocket::close(desc);
+            });
+
+            histogram total;
+            uint64_t total_lost = 0;
+
+            for (int32_t i = 0; i < cfg.threads; i++) {
+                total.merge(hists[i]);
+                total_lost += lost[i];
+            }
+
+            report::fields fields = report::latency(total);
+            fields.push_back({"lost", report::number(total_lost)});
+            p99 = total.percentile(99);
+
+            if (spin_us) {
+                report::fields spin = spin_fields(spin_us, p99, baseline_p99, before);
+                fields.insert(fields.end(), spin.begin(), spin.end());
+            }
+
+            rep.add(spin_us ? "udp.pingpong_spin" : "udp.pingpong", "udp", cfg, fields);
+        }
+
+        libsocket::close(sock);
+
+        return p99;
+    }
+
+    // Asks a counting UDP peer how many datagrams it has seen so far.
+    uint64_t udp_delivered(libsocket::address addr) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        libsocket::descriptor control = libsocket::ipv4::udp::socket();
+        std::string delivered = "0";
+
+        set_timeout(control, 200);
+
+        for (int32_t attempt = 0; attempt < 10; attempt++) {
+            try {
+                libsocket::writestringto(control, "?", addr);
+                delivered = libsocket::readstringfrom(control, 64).data;
+
+                if (!delivered.empty()) break;
+            }
+
+            catch (const std::exception&) {}
+        }
+
+        libsocket::close(control);
+
+        return std::stoull(delivered.empty() ? "0" : delivered);
+    }
+
+    void udp_pps(report& rep, const config& cfg) {
+        libsocket::address addr;
+        libsocket::descriptor sock = udp_server_socket(addr);
+
+        {
+            uint64_t received = 0;
+
+            server peer(1, [&] {
+                libsocket::datagram dgram = libsocket::readfrom(sock, 1 << 16);
+
+                if (dgram.data.size() == 1 && dgram.data[0] == '?') {
+                    std::string count = std::to_string(received);
+
+                    libsocket::writeto(sock, std::vector<int8_t>(count.begin(), count.end()), dgram.addr);
+                }
+
+                else received++;
+            });
+
+            std::vector<uint64_t> sent(cfg.threads, 0);
+            clock::time_point start = clock::now();
+
+            run_threads(cfg.threads, [&](int32_t idx) {
+                libsocket::descriptor desc = libsocket::ipv4::udp::socket();
+                std::vector<int8_t> message(std::max<int64_t>(cfg.size, 2), 'x');
+                clock::time_point deadline = clock::now() + std::chrono::milliseconds(cfg.duration_ms);
+
+                while (clock::now() < deadline) if (libsocket::writeto(desc, message, addr) > 0) sent[idx]++;
+
+                libsocket::close(desc);
+            });
+
+            uint64_t ns = elapsed_ns(start);
+            uint64_t total_sent = 0;
+
+            for (uint64_t count : sent) total_sent += count;
+
+            uint64_t total_received = udp_delivered(addr);
+
+            rep.add("udp.pps", "udp", cfg, {
+                {"sent", report::number(total_sent)},
+                {"received", report::number(total_received)},
+                {"elapsed_ns", report::number(ns)},
+                {"sent_pps", report::number(per_second(total_sent, ns))},
+                {"received_pps", report::number(per_second(total_received, ns))}
+            });
+        }
+
+        libsocket::close(sock);
+    }
+
+    // The same datagram stream sent with one sendto() per datagram and with UDP GSO, to a
+    // peer that has UDP GRO enabled and counts segments.
+    void udp_segmented(report& rep, const config& cfg) {
+        int32_t segment = std::clamp<int64_t>(cfg.size, 2, 1472);
+        uint64_t segments = std::min<uint64_t>(libsocket::utils::gso_max_segments, libsocket::utils::gso_max_bytes / segment);
+
+        for (bool gso : {false, true}) {
+            libsocket::address addr;
+            libsocket::descriptor sock = udp_server_socket(addr);
+
+            libsocket::udp_gro(sock);
+
+            {
+                uint64_t received = 0;
+
+                server peer(1, [&] {
+                    libsocket::datagram dgram = libsocket::readfrom(sock, 1 << 16);
+
+                    if (dgram.data.size() == 1 && dgram.data[0] == '?') {
+                        std::string count = std::to_string(received);
+
+                        libsocket::writeto(sock, std::vector<int8_t>(count.begin(), count.end()), dgram.addr);
+                    }
+
+                    else received += dgram.segment_size ? (dgram.data.size() + dgram.segment_size - 1) / dgram.segment_size : 1;
+                });
+
+                libsocket::descriptor desc = libsocket::ipv4::udp::socket();
+                std::vector<int8_t> message(segment, 'x');
+                std::vector<int8_t> batch(segment * segments, 'x');
+
+                uint64_t sent = 0;
+                clock::time_point start = clock::now();
+                clock::time_point deadline = start + std::chrono::milliseconds(cfg.duration_ms);
+
+                while (clock::now() < deadline) {
+                    if (!gso) {
+                        if (libsocket::writeto(desc, message, addr) > 0) sent++;
+
+                        continue;
+                    }
+
+                    int64_t bytes = 0;
+
+                    try { bytes = libsocket::writeto_segmented(desc, batch, segment, addr); }
+                    catch (const std::runtime_error&) {}
+
+                    if (bytes > 0) sent += (bytes + segment - 1) / segment;
+                }
+
+                uint64_t ns = elapsed_ns(start);
+
+                libsocket::close(desc);
+
+                uint64_t total_received = udp_delivered(addr);
+
+                rep.add(gso ? "udp.gso" : "udp.sendto", "udp", cfg, {
+                    {"segment_size", report::number(segment)},
+                    {"segments_per_call", report::number(gso ? segments : 1)},
+                    {"sent", report::number(sent)},
+                    {"received", report::number(total_received)},
+                    {"elapsed_ns", report::number(ns)},
+                    {"sent_pps", report::number(per_second(sent, ns))},
+                    {"received_pps", report::number(per_second(total_received, ns))}
+                });
+            }
+
+            libsocket::close(sock);
+        }
+    }
+
+    // Forks `procs` children running `body`; collect() sums the counts they return. Fork
+    // before starting server threads so no child inherits a held lock.
+    std::vector<std::pair<pid_t, int32_t>> spawn(int32_t procs, std::function<uint64_t(int32_t)> body) {
+        std::vector<std::pair<pid_t, int32_t>> children;
+
+        for (int32_t i = 0; i < procs; i++) {
+            int32_t fds[2];
+
+            if (pipe(fds) == -1) throw std::runtime_error("pipe(): " + std::string(strerror(errno)));
+
+            pid_t pid = fork();
+
+            if (pid == -1) throw std::runtime_error("fork(): " + std::string(strerror(errno)));
+
+            if (pid == 0) {
+                uint64_t count = 0;
+
+                try { count = body(i); }
+                catch (const std::exception&) {}
+
+                if (write(fds[1], &count, sizeof(count)) != sizeof(count)) _exit(1);
+
+                _exit(0);
+            }
+
+            close(fds[1]);
+            children.push_back({pid, fds[0]});
+        }
+
+        return children;
+    }
+
+    uint64_t collect(const std::vector<std::pair<pid_t, int32_t>>& children) {
+        uint64_t total = 0;
+
+        for (auto [pid, fd] : children) {
+            uint64_t count = 0;
+
+            if (read(fd, &count, sizeof(count)) == sizeof(count)) total += count;
+
+            close(fd);
+            waitpid(pid, nullptr, 0);
+        }
+
+        return total;
+    }
+
+    // Handshake rate of a handshake_pool with `threads` crypto threads against forked clients
+    // that connect, handshake and disconnect in a loop for `duration_ms`.
+    void tls_offload(report& rep, const config& cfg, transport tr, tls_state& tls) {
+        libsocket::descriptor listener = listen_on(tr);
+
+        std::vector<std::pair<pid_t, int32_t>> children = spawn(std::max(cfg.threads, 2), [&](int32_t) {
+            clock::time_point deadline = clock::now() + std::chrono::milliseconds(cfg.duration_ms);
+            uint64_t done = 0;
+
+            while (clock::now() < deadline) {
+                libsocket::descriptor desc = client_connect(tr, tls);
+
+                server_close(desc, tr);
+                done++;
+            }
+
+            return done;
+        });
+
+        libsocket::handshake_stats stats;
+        uint64_t ns;
+
+        {
+            libsocket::handshake_pool pool({static_cast<size_t>(cfg.threads)});
+            clock::time_point start = clock::now();
+
+            pool.serve(listener, tls.server_ctx, [&tr](libsocket::descriptor desc, bool) {
+                server_close(desc, tr);
+            });
+
+            collect(children);
+
+            ns = elapsed_ns(start);
+            stats = pool.stats();
+        }
+
+        libsocket::close(listener);
+
+        rep.add("tls.handshake_pool", tr.name, cfg, {
+            {"handshakes", report::number(stats.completed)},
+            {"failed", report::number(stats.failed)},
+            {"rejected", report::number(stats.rejected)},
+            {"elapsed_ns", report::number(ns)},
+            {"per_sec", report::number(per_second(stats.completed, ns))}
+        });
+    }
+
+    // Echo server on a worker_pool whose handler burns `work_us` of CPU per request, driven
+    // by forked clients keeping one request in flight per connection; repeated for 1..N workers.
+    void pool_scaling(report& rep, const config& cfg) {
+        int32_t cores = std::max(1u, std::thread::hardware_concurrency());
+        int32_t procs = std::max(cfg.threads, std::min(cores, 4));
+        int64_t per_proc = std::max<int64_t>(1, std::min<int64_t>(cfg.connections, 64) / procs);
+        double baseline = 0;
+
+        for (int32_t workers = 1; workers <= cores; workers = workers < cores ? std::min(workers * 2, cores) : cores + 1) {
+            transport tr{"tcp", libsocket::ipv4::tcp::socket, libsocket::address(127, 0, 0, 1, 0)};
+            libsocket::descriptor listener = listen_on(tr);
+
+            std::vector<std::pair<pid_t, int32_t>> children = spawn(procs, [&](int32_t) {
+                std::vector<libsocket::descriptor> conns;
+                std::vector<int8_t> message(cfg.size, 'x');
+                uint64_t done = 0;
+
+                for (int64_t i = 0; i < per_proc; i++) {
+                    conns.push_back(tr.open());
+                    libsocket::connect(conns.back(), tr.addr);
+                }
+
+                clock::time_point deadline = clock::now() + std::chrono::milliseconds(cfg.duration_ms);
+
+                while (clock::now() < deadline) {
+                    for (libsocket::descriptor desc : conns) send_all(desc, message, tr);
+                    for (libsocket::descriptor desc : conns) recv_exact(desc, cfg.size, tr);
+
+                    done += conns.size();
+                }
+
+                return done;
+            });
+
+            uint64_t requests;
+            uint64_t ns;
+            std::vector<libsocket::worker_stats> stats;
+
+            {
+                libsocket::worker_pool pool(workers);
+                clock::time_point start = clock::now();
+
+                pool.serve(listener, [&cfg, &tr](libsocket::descriptor desc) {
+                    std::vector<int8_t> buffer = libsocket::read(desc, cfg.size, MSG_DONTWAIT);
+
+                    if (buffer.empty()) {
+                        libsocket::close(desc);
+
+                        return false;
+                    }
+
+                    clock::time_point until = clock::now() + std::chrono::microseconds(cfg.work_us);
+
+                    while (clock::now() < until);
+
+                    send_all(desc, buffer, tr);
+
+                    return true;
+                });
+
+                requests = collect(children);
+                ns = elapsed_ns(start);
+                stats = pool.stats();
+            }
+
+            libsocket::close(listener);
+
+            uint64_t stolen = 0;
+
+            for (libsocket::worker_stats& s : stats) stolen += s.stolen;
+
+            double rate = per_second(requests, ns);
+
+            if (workers == 1) baseline = rate;
+
+            rep.add("pool.scaling", "tcp", cfg, {
+                {"workers", report::number(workers)},
+                {"connections", report::number(per_proc * procs)},
+                {"work_us", report::number(cfg.work_us)},
+                {"requests", report::number(requests)},
+                {"elapsed_ns", report::number(ns)},
+                {"requests_per_sec", report::number(rate)},
+                {"stolen", report::number(stolen)},
+                {"speedup", report::number(baseline ? rate / baseline : 0)}
+            });
+        }
+    }
+
+    void usage() {
+        std::cerr << "usage: libsocket_bench [--suite tcp,udp,unix,tls,shm,gso,pool] [--threads N] [--size BYTES]\n"
+                     "                       [--iterations N] [--duration-ms MS] [--connections N] [--spin-us US]\n"
+                     "                       [--work-us US] [--output FILE]" << std::endl;
+    }
+
+    config parse(int argc, char** argv) {
+        config cfg;
+
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+
+            if (arg == "--help" || arg == "-h") {
+                usage();
+                exit(0);
+            }
+
+            if (i + 1 >= argc) throw std::invalid_argument("missing value for " + arg);
+
+            std::string value = argv[++i];
+
+            if (arg == "--suite") {
+                cfg.suites.clear();
+
+                std::stringstream list(value);
+
+                for (std::string suite; std::getline(list, suite, ',');) cfg.suites.insert(suite);
+            }
+
+            else if (arg == "--threads") cfg.threads = std::max(1, std::stoi(value));
+            else if (arg == "--size") cfg.size = std::max<int64_t>(1, std::stoll(value));
+            else if (arg == "--iterations") cfg.iterations = std::stoll(value);
+            else if (arg == "--duration-ms") cfg.duration_ms = std::stoll(value);
+            else if (arg == "--connections") cfg.connections = std::stoll(value);
+            else if (arg == "--spin-us") cfg.spin_us = std::max(0, std::stoi(value));
+            else if (arg == "--work-us") cfg.work_us = std::max(0, std::stoi(value));
+            else if (arg == "--output") cfg.output = value;
+            else throw std::invalid_argument("unknown option " + arg);
+        }
+
+        return cfg;
+    }
+}
+
+int main(int argc, char** argv) {
+    bench::config cfg;
+
+    try { cfg = bench::parse(argc, argv); }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        bench::usage();
+
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    bench::report rep;
+    bench::tls_state tls = bench::make_tls();
+
+    bench::transport tcp{"tcp", libsocket::ipv4::tcp::socket, libsocket::address(127, 0, 0, 1, 0)};
+    bench::transport tls_tcp{"tls", libsocket::ipv4::tcp::socket, libsocket::address(127, 0, 0, 1, 0), bench::layer::tls};
+    bench::transport unix_stream{"unix", libsocket::unix::socket, libsocket::address("/tmp/libsocket_bench_" + std::to_string(getpid()) + ".sock")};
+    bench::transport shm_ring{"shm", libsocket::unix::socket, unix_stream.addr, bench::layer::shm};
+
+    try {
+        for (bench::transport tr : {tcp, unix_stream, tls_tcp, shm_ring}) {
+            if (!cfg.suites.count(tr.name)) continue;
+
+            uint64_t p99 = bench::stream_pingpong(rep, cfg, tr, tls);
+
+            if (cfg.spin_us && tr.over == bench::layer::plain) bench::stream_pingpong(rep, cfg, tr, tls, cfg.spin_us, p99);
+
+            bench::stream_throughput(rep, cfg, tr, tls);
+
+            if (tr.over != bench::layer::shm) bench::stream_accept(rep, cfg, tr, tls);
+            if (tr.over == bench::layer::tls) bench::tls_offload(rep, cfg, tr, tls);
+        }
+
+        if (cfg.suites.count("udp")) {
+            uint64_t p99 = bench::udp_pingpong(rep, cfg);
+
+            if (cfg.spin_us) bench::udp_pingpong(rep, cfg, cfg.spin_us, p99);
+            bench::udp_pps(rep, cfg);
+        }
+
+        if (cfg.suites.count("gso")) bench::udp_segmented(rep, cfg);
+        if (cfg.suites.count("pool")) bench::pool_scaling(rep, cfg);
+    }
+
+    catch (const std::exception& e) {
+        std::cerr << "libsocket_bench: " << e.what() << std::endl;
+
+        return 1;
+    }
+
+    libsocket::unix::unlink(unix_stream.addr.string());
+
+    if (cfg.output.empty()) rep.print(std::cout, cfg);
+    else {
+        std::ofstream out(cfg.output);
+        rep.print(out, cfg);
+    }
+
+    libsocket::utils::ssl::free_context(tls.server_ctx);
+    libsocket::utils::ssl::free_context(tls.client_ctx);
+}
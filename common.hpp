@@ -3,18 +3,33 @@
 #include <vector>
 #include <stdexcept>
 #include <mutex>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 
 #include "def.hpp"
 #include "socket.hpp"
 #include "address.hpp"
 #include "utils.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 
 namespace libsocket {
+    struct accepted_connection {
+        descriptor desc;
+        std::vector<int8_t> data;
+    };
+
     void connect(descriptor desc, address addr) {
-        std::unique_lock lock(socket_table_mutex);
+        libsocket::trace::scope span(libsocket::trace::event::connect, desc.id);
+
+        std::unique_lock lock = libsocket::utils::lock_table();
 
         if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("connect(): socket closed");
 
@@ -32,7 +47,9 @@ namespace libsocket {
     }
 
     void connect(descriptor desc, address_list addr_list) {
-        std::unique_lock lock(socket_table_mutex);
+        libsocket::trace::scope span(libsocket::trace::event::connect, desc.id);
+
+        std::unique_lock lock = libsocket::utils::lock_table();
 
         if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("connect(): socket closed");
 
@@ -55,8 +72,60 @@ namespace libsocket {
         if (!sock.working) throw std::runtime_error("connect(): Unable to connect to host: " + std::string(strerror(errno)));
     }
 
+    // TCP Fast Open: `buffer` rides on the SYN when the kernel holds a cookie for `addr`,
+    // saving a round trip; on first contact it follows the handshake. Falls back to connect()
+    // and write() when TFO is disabled (net.ipv4.tcp_fastopen). Returns the bytes sent; a
+    // non-blocking socket without a cookie returns 0 with the connection in progress.
+    int64_t connect(descriptor desc, address addr, std::vector<int8_t> buffer) {
+        libsocket::trace::scope span(libsocket::trace::event::connect, desc.id);
+
+        std::unique_lock lock = libsocket::utils::lock_table();
+
+        if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("connect(): socket closed");
+
+        libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+        if (addr.family() != sock.family) throw std::runtime_error("connect(): Invalid address family");
+        if (sock.type != SOCK_STREAM || sock.family == AF_UNIX) throw std::runtime_error("connect(): Not a TCP socket");
+
+        libsocket::utils::pin pin(sock);
+        lock.unlock();
+
+        std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.sendMtx);
+
+        sockaddr_storage tmp_addr = addr;
+
+        const char* failed = "Unable to connect to host";
+        int64_t sent = ::sendto(sock.fd, buffer.data(), buffer.size(), MSG_FASTOPEN, reinterpret_cast<sockaddr*>(&tmp_addr), sock.sockaddr_size);
+
+        if (sent == -1 && errno == EOPNOTSUPP) {
+            if (::connect(sock.fd, reinterpret_cast<sockaddr*>(&tmp_addr), sock.sockaddr_size) == -1) throw std::runtime_error("connect(): Unable to connect to host: " + std::string(strerror(errno)));
+
+            sent = ::send(sock.fd, buffer.data(), buffer.size(), 0);
+            failed = "Unable to send data";
+        }
+
+        if (sent == -1 && errno == EINPROGRESS) sent = 0;
+        else libsocket::utils::count_write(sock, sent, buffer.size());
+
+        if (sent == -1) throw std::runtime_error("connect(): " + std::string(failed) + ": " + strerror(errno));
+
+        sock_lock.unlock();
+        lock.lock();
+
+        sock.working = true;
+        sock.laddress = libsocket::utils::getsockname(desc);
+        sock.raddress = addr;
+
+        return sent;
+    }
+
+    int64_t connectstring(descriptor desc, address addr, std::string string) {
+        return connect(desc, addr, std::vector<int8_t>(string.begin(), string.end()));
+    }
+
     void bind(descriptor desc, address addr) {
-        std::unique_lock lock(socket_table_mutex);
+        std::unique_lock lock = libsocket::utils::lock_table();
 
         if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("bind(): socket closed");
 
@@ -73,7 +142,7 @@ namespace libsocket {
     }
 
     void bind(descriptor desc, address_list addr_list) {
-        std::unique_lock lock(socket_table_mutex);
+        std::unique_lock lock = libsocket::utils::lock_table();
 
         if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("bind(): socket closed");
 
@@ -96,65 +165,136 @@ namespace libsocket {
     }
 
     descriptor accept(descriptor desc) {
-        std::unique_lock lock(socket_table_mutex);
+        libsocket::trace::scope span(libsocket::trace::event::accept, desc.id);
+
+        std::unique_lock lock = libsocket::utils::lock_table();
 
         if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("accept(): socket closed");
 
         libsocket::utils::socket& sock = socket_table.at(desc.id);
 
+        libsocket::utils::pin pin(sock);
+        lock.unlock();
+
+        std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.recvMtx);
+
         sockaddr_storage addr;
         socklen_t socklen = sock.sockaddr_size;
 
         int32_t new_fd = ::accept(sock.fd, reinterpret_cast<sockaddr*>(&addr), &socklen);
 
-        if (new_fd == -1) throw std::runtime_error("accept(): Unable to accept connection: " + std::string(strerror(errno)));
+        if (new_fd == -1) {
+            libsocket::utils::count_error(sock);
+
+            throw std::runtime_error("accept(): Unable to accept connection: " + std::string(strerror(errno)));
+        }
 
-        int32_t id = libsocket::utils::random_s32(libsocket::utils::mersenne);
-        uint64_t fingerprint = libsocket::utils::random_u64(libsocket::utils::mersenne);
+        libsocket::utils::count(sock, &libsocket::stats::counters::accepts, 1);
 
-        descriptor new_desc = {id, fingerprint};
+        sock_lock.unlock();
+        lock.lock();
 
-        libsocket::utils::socket& new_sock = socket_table.try_emplace(id).first->second;
+        descriptor new_desc = libsocket::utils::emplace_socket(new_fd, sock.family, sock.type);
 
-        new_sock.fd = new_fd;
-        new_sock.fingerprint = fingerprint;
+        libsocket::utils::socket& new_sock = socket_table.at(new_desc.id);
 
         new_sock.working = true;
-        new_sock.blocking = true;
-        new_sock.listen = false;
         new_sock.accepted = true;
 
-        new_sock.family = AF_INET;
-        new_sock.type = SOCK_STREAM;
-        new_sock.sockaddr_size = sock.sockaddr_size;
-
         new_sock.laddress = libsocket::utils::getsockname(new_desc);
         new_sock.raddress = address::from_sockaddr(addr);
 
         return new_desc;
     }
 
-    void listen(descriptor desc, int32_t __listen) {
-        std::unique_lock lock(socket_table_mutex);
+    // `fastopen` > 0 enables TCP Fast Open with that many pending TFO requests; the server
+    // side also needs bit 2 of net.ipv4.tcp_fastopen.
+    void listen(descriptor desc, int32_t __listen, int32_t fastopen = 0) {
+        std::unique_lock lock = libsocket::utils::lock_table();
 
         if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("listen(): socket closed");
 
         libsocket::utils::socket& sock = socket_table.at(desc.id);
 
+        if (fastopen > 0 && (sock.type != SOCK_STREAM || sock.family == AF_UNIX)) throw std::runtime_error("listen(): Not a TCP socket");
+        if (fastopen > 0 && ::setsockopt(sock.fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(fastopen)) == -1) throw std::runtime_error("listen(): Unable to set TCP_FASTOPEN: " + std::string(strerror(errno)));
+
         if (::listen(sock.fd, __listen) == -1) throw std::runtime_error("listen(): Unable to listen to host: " + std::string(strerror(errno)));
 
         sock.listen = true;
     }
 
+    // TCP_DEFER_ACCEPT: accept() only wakes once the client has sent data, or after about
+    // `seconds` without any, when the connection is handed over empty (0 disables).
+    void defer_accept(descriptor desc, int32_t seconds) {
+        std::unique_lock lock = libsocket::utils::lock_table();
+
+        if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("defer_accept(): socket closed");
+
+        libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+        if (sock.type != SOCK_STREAM || sock.family == AF_UNIX) throw std::runtime_error("defer_accept(): Not a TCP socket");
+
+        if (::setsockopt(sock.fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) == -1) throw std::runtime_error("defer_accept(): Unable to set TCP_DEFER_ACCEPT: " + std::string(strerror(errno)));
+    }
+
+    // Low-latency receive mode: read()/readfrom() poll with MSG_DONTWAIT for up to
+    // `budget_us` before blocking (0 disables it). SO_BUSY_POLL and SO_PREFER_BUSY_POLL are
+    // requested too; returns whether the kernel took them (raising SO_BUSY_POLL above
+    // net.core.busy_read needs CAP_NET_ADMIN). With a single usable CPU the spin would only
+    // keep the peer from running, so it stays off and false is returned.
+    bool busy_poll(descriptor desc, int32_t budget_us) {
+        std::unique_lock lock = libsocket::utils::lock_table();
+
+        if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("busy_poll(): socket closed");
+
+        libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+        bool useful = libsocket::utils::usable_cpus() > 1;
+
+        if (!useful) budget_us = 0;
+
+        sock.spin_ns = static_cast<int64_t>(budget_us) * 1000;
+
+        bool kernel = ::setsockopt(sock.fd, SOL_SOCKET, SO_BUSY_POLL, &budget_us, sizeof(budget_us)) == 0;
+
+#ifdef SO_PREFER_BUSY_POLL
+        int32_t prefer = budget_us > 0;
+
+        kernel = ::setsockopt(sock.fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) == 0 && kernel;
+#endif
+
+        return useful && kernel;
+    }
+
+    // Empty on EOF, on EAGAIN (non-blocking or SO_RCVTIMEO expired); throws on other errors.
     std::vector<int8_t> read(descriptor desc, int64_t size, int32_t flags = 0) {
-        std::unique_lock lock(socket_table_mutex);
+        libsocket::trace::scope span(libsocket::trace::event::read, desc.id);
+
+        std::unique_lock lock = libsocket::utils::lock_table();
 
         if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("read(): socket closed");
 
         libsocket::utils::socket& sock = socket_table.at(desc.id);
 
+        libsocket::utils::pin pin(sock);
+        lock.unlock();
+
+        std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.recvMtx);
+
         std::vector<int8_t> buffer(size);
-        buffer.resize(::recv(sock.fd, buffer.data(), size, flags));
+        int64_t received = libsocket::utils::spin_recv(sock, flags, [&](int32_t recv_flags) {
+            return ::recv(sock.fd, buffer.data(), size, recv_flags);
+        });
+
+        libsocket::utils::count_read(sock, received);
+
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) received = 0;
+            else throw std::runtime_error("read(): Unable to read from socket: " + std::string(strerror(errno)));
+        }
+
+        buffer.resize(received);
 
         return buffer;
     }
@@ -165,34 +305,91 @@ namespace libsocket {
         return std::string(buffer.begin(), buffer.end());
     }
 
-    int64_t write(descriptor desc, std::vector<int8_t> buffer, int32_t flags = 0) {
-        std::unique_lock lock(socket_table_mutex);
+    int64_t write(descriptor desc, const int8_t* data, size_t size, int32_t flags = 0) {
+        libsocket::trace::scope span(libsocket::trace::event::write, desc.id);
+
+        std::unique_lock lock = libsocket::utils::lock_table();
 
         if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("read(): socket closed");
 
         libsocket::utils::socket& sock = socket_table.at(desc.id);
 
-        return ::send(sock.fd, buffer.data(), buffer.size(), flags);
+        libsocket::utils::pin pin(sock);
+        lock.unlock();
+
+        std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.sendMtx);
+
+        int64_t sent = ::send(sock.fd, data, size, flags);
+
+        libsocket::utils::count_write(sock, sent, size);
+
+        return sent;
+    }
+
+    int64_t write(descriptor desc, std::vector<int8_t> buffer, int32_t flags = 0) {
+        return libsocket::write(desc, buffer.data(), buffer.size(), flags);
     }
 
     int64_t writestring(descriptor desc, std::string string, int32_t flags = 0) {
         return write(desc, std::vector<int8_t>(string.begin(), string.end()), flags);
     }
 
+    // Same error handling as read(); an empty datagram may also be a zero-length one.
     datagram readfrom(descriptor desc, int64_t size, int32_t flags = 0) {
-        std::unique_lock lock(socket_table_mutex);
+        libsocket::trace::scope span(libsocket::trace::event::readfrom, desc.id);
+
+        std::unique_lock lock = libsocket::utils::lock_table();
 
         if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("read(): socket closed");
 
         libsocket::utils::socket& sock = socket_table.at(desc.id);
 
-        sockaddr_storage tmp_addr;
+        libsocket::utils::pin pin(sock);
+        lock.unlock();
+
+        std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.recvMtx);
+
+        sockaddr_storage tmp_addr{};
         socklen_t socklen = sock.sockaddr_size;
 
+        tmp_addr.ss_family = sock.family;
+
         std::vector<int8_t> buffer(size);
-        buffer.resize(::recvfrom(sock.fd, buffer.data(), size, flags, reinterpret_cast<sockaddr*>(&tmp_addr), &socklen));
+        int32_t segment_size = 0;
+
+        int64_t received = libsocket::utils::spin_recv(sock, flags, [&](int32_t recv_flags) -> int64_t {
+            if (!sock.gro) return ::recvfrom(sock.fd, buffer.data(), size, recv_flags, reinterpret_cast<sockaddr*>(&tmp_addr), &socklen);
+
+            alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int32_t))];
+            iovec iov{buffer.data(), static_cast<size_t>(size)};
+
+            msghdr msg{};
+            msg.msg_name = &tmp_addr;
+            msg.msg_namelen = socklen;
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            int64_t result = ::recvmsg(sock.fd, &msg, recv_flags);
+
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); result >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) std::memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+            }
+
+            return result;
+        });
+
+        libsocket::utils::count_read(sock, received);
+
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) received = 0;
+            else throw std::runtime_error("readfrom(): Unable to read from socket: " + std::string(strerror(errno)));
+        }
 
-        return {address::from_sockaddr(tmp_addr), buffer};
+        buffer.resize(received);
+
+        return {address::from_sockaddr(tmp_addr), buffer, segment_size};
     }
 
     string_datagram readstringfrom(descriptor desc, int64_t size, int32_t flags = 0) {
@@ -202,23 +399,125 @@ namespace libsocket {
     }
 
     int64_t writeto(descriptor desc, std::vector<int8_t> buffer, address addr, int32_t flags = 0) {
-        std::unique_lock lock(socket_table_mutex);
+        libsocket::trace::scope span(libsocket::trace::event::writeto, desc.id);
+
+        std::unique_lock lock = libsocket::utils::lock_table();
 
         if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("read(): socket closed");
 
         libsocket::utils::socket& sock = socket_table.at(desc.id);
 
+        libsocket::utils::pin pin(sock);
+        lock.unlock();
+
+        std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.sendMtx);
+
         sockaddr_storage tmp_addr = addr;
 
-        return ::sendto(sock.fd, buffer.data(), buffer.size(), flags, reinterpret_cast<sockaddr*>(&tmp_addr), sizeof(tmp_addr));
+        int64_t sent = ::sendto(sock.fd, buffer.data(), buffer.size(), flags, reinterpret_cast<sockaddr*>(&tmp_addr), sizeof(tmp_addr));
+
+        libsocket::utils::count_write(sock, sent, buffer.size());
+
+        return sent;
     }
 
     int64_t writestringto(descriptor desc, std::string string, address addr, int32_t flags = 0) {
         return writeto(desc, std::vector<int8_t>(string.begin(), string.end()), addr, flags);
     }
 
+    // UDP GSO: sends `buffer` as consecutive datagrams of `segment_size` bytes (the last one
+    // may be shorter), handing the kernel up to gso_max_segments of them per sendmsg().
+    // Segments must fit the path MTU. Returns the bytes sent, 0 on EAGAIN, and throws if
+    // nothing could be sent. A short count means a later batch failed: errno holds the
+    // reason and the rest of `buffer` was not sent.
+    int64_t writeto_segmented(descriptor desc, const std::vector<int8_t>& buffer, int32_t segment_size, address addr, int32_t flags = 0) {
+        libsocket::trace::scope span(libsocket::trace::event::writeto, desc.id);
+
+        if (segment_size <= 0 || segment_size > libsocket::utils::gso_max_bytes) throw std::runtime_error("writeto_segmented(): Invalid segment size");
+
+        std::unique_lock lock = libsocket::utils::lock_table();
+
+        if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("writeto_segmented(): socket closed");
+
+        libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+        if (sock.type != SOCK_DGRAM || sock.family == AF_UNIX) throw std::runtime_error("writeto_segmented(): Not a UDP socket");
+        if (addr.family() != sock.family) throw std::runtime_error("writeto_segmented(): Invalid address family");
+
+        libsocket::utils::pin pin(sock);
+        lock.unlock();
+
+        std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.sendMtx);
+
+        sockaddr_storage tmp_addr = addr;
+
+        uint64_t segments = std::min<uint64_t>(libsocket::utils::gso_max_segments, libsocket::utils::gso_max_bytes / segment_size);
+        uint64_t batch = segments * segment_size;
+        uint64_t total = 0;
+
+        while (total < buffer.size()) {
+            uint64_t size = std::min<uint64_t>(batch, buffer.size() - total);
+
+            alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(uint16_t))] = {};
+            iovec iov{const_cast<int8_t*>(buffer.data()) + total, size};
+
+            msghdr msg{};
+            msg.msg_name = &tmp_addr;
+            msg.msg_namelen = sock.sockaddr_size;
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+
+            // A single segment goes out as a plain datagram.
+            if (size > static_cast<uint64_t>(segment_size)) {
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+
+                cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+                uint16_t gso_size = segment_size;
+                std::memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+            }
+
+            int64_t sent = ::sendmsg(sock.fd, &msg, flags);
+            int32_t error = errno;
+
+            libsocket::utils::count_write(sock, sent, size);
+
+            if (sent == -1) {
+                errno = error;
+
+                if (total || error == EAGAIN || error == EWOULDBLOCK) return total;
+
+                throw std::runtime_error("writeto_segmented(): Unable to send datagrams: " + std::string(strerror(error)));
+            }
+
+            total += sent;
+        }
+
+        return total;
+    }
+
+    // UDP GRO: lets the kernel coalesce datagrams of one flow; readfrom() then returns them
+    // as one buffer with datagram::segment_size set, so read with a size of at least 64 KiB.
+    void udp_gro(descriptor desc, bool enable = true) {
+        std::unique_lock lock = libsocket::utils::lock_table();
+
+        if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("udp_gro(): socket closed");
+
+        libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+        int32_t value = enable;
+
+        if (::setsockopt(sock.fd, SOL_UDP, UDP_GRO, &value, sizeof(value)) == -1) throw std::runtime_error("udp_gro(): Unable to set UDP_GRO: " + std::string(strerror(errno)));
+
+        sock.gro = enable;
+    }
+
     void shutdown(descriptor desc) {
-        std::unique_lock lock(socket_table_mutex);
+        std::unique_lock lock = libsocket::utils::lock_table();
 
         if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("shutdown(): socket closed");
 
@@ -229,15 +528,45 @@ namespace libsocket {
         sock.working = false;
     }
 
+    // Marks the socket closing so no new call starts on it, wakes calls blocked on it in
+    // other threads and waits for them to return before the fd is closed and the entry erased.
     void close(descriptor desc) {
-        std::unique_lock lock(socket_table_mutex);
+        std::unique_lock lock = libsocket::utils::lock_table();
 
         if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("close(): socket closed");
 
         libsocket::utils::socket& sock = socket_table.at(desc.id);
 
+        // Waiting for our own call to return would never end.
+        if (libsocket::utils::pinned_here(sock)) throw std::runtime_error("close(): Socket in use by this thread");
+
+        sock.closing = true;
+        lock.unlock();
+
+        // shutdown() also hangs up copies of the fd held elsewhere, so only when a call is in flight.
+        if (sock.users) ::shutdown(sock.fd, SHUT_RDWR);
+
+        while (uint32_t users = sock.users) libsocket::utils::futex_wait(sock.users, users);
+
+        for (void (*hook)(int32_t) : libsocket::utils::close_hooks) hook(desc.id);
+
         ::close(sock.fd);
 
+        lock.lock();
         socket_table.erase(desc.id);
     }
+
+    // Accepts and reads up to `size` bytes that have already arrived, without waiting: the
+    // TFO payload, or the request that TCP_DEFER_ACCEPT held the connection back for. `data`
+    // is empty if the client has not sent anything yet.
+    accepted_connection accept(descriptor desc, int64_t size) {
+        descriptor client = accept(desc);
+
+        try { return {client, read(client, size, MSG_DONTWAIT)}; }
+        catch (const std::runtime_error&) {
+            close(client);
+
+            throw;
+        }
+    }
 }
@@ -17,6 +17,7 @@ namespace libsocket {
     struct datagram {
         address addr;
         std::vector<int8_t> data;
+        int32_t segment_size = 0; // set when UDP GRO coalesced several datagrams into `data`
     };
 
     struct string_datagram {
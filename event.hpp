@@ -0,0 +1,421 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <stdexcept>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "def.hpp"
+#include "socket.hpp"
+#include "utils.hpp"
+#include "common.hpp"
+
+namespace libsocket {
+    namespace utils::event {
+        constexpr int32_t max_events = 256;
+        constexpr uint64_t wakeup_key = ~0ULL;
+        constexpr uint64_t fd_key = 1ULL << 32;     // tags raw fds apart from descriptor ids
+
+        using callback = std::shared_ptr<std::function<void()>>;
+
+        struct handler {
+            fd_t fd;
+            callback on_read;
+            callback on_write;
+        };
+
+        struct timer {
+            std::chrono::steady_clock::time_point deadline;
+            std::chrono::milliseconds interval;
+            callback fn;
+        };
+
+        fd_t fd_of(descriptor desc, const char* call) {
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error(std::string(call) + "(): socket closed");
+
+            return socket_table.at(desc.id).fd;
+        }
+    }
+
+    // Level-triggered epoll loop. A descriptor has at most one read and one write callback,
+    // and its interest set follows whichever of them is installed. Callbacks run on the
+    // thread inside run() and may add or remove callbacks, including their own.
+    class event_loop {
+        fd_t __epoll;
+        fd_t __wakeup;
+
+        std::map<int32_t, libsocket::utils::event::handler> __handlers;
+        std::map<fd_t, libsocket::utils::event::callback> __fd_handlers;
+        std::vector<std::function<void()>> __posted;
+        std::map<uint64_t, libsocket::utils::event::timer> __timers;
+        uint64_t __next_timer = 1;
+        std::mutex __mtx;
+
+        std::atomic_bool __running = false;
+
+        void update(descriptor desc, libsocket::utils::event::callback libsocket::utils::event::handler::* slot, std::function<void()> cb, const char* call) {
+            std::unique_lock lock(__mtx);
+
+            auto it = __handlers.find(desc.id);
+            bool existed = it != __handlers.end();
+
+            if (!existed) {
+                if (!cb) return;
+
+                it = __handlers.emplace(desc.id, libsocket::utils::event::handler{libsocket::utils::event::fd_of(desc, call), nullptr, nullptr}).first;
+            }
+
+            libsocket::utils::event::handler& h = it->second;
+
+            h.*slot = cb ? std::make_shared<std::function<void()>>(std::move(cb)) : nullptr;
+
+            epoll_event ev{};
+            ev.events = (h.on_read ? static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP) : 0u) | (h.on_write ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+            ev.data.u64 = static_cast<uint32_t>(desc.id);
+
+            int32_t status;
+
+            if (!ev.events) {
+                status = ::epoll_ctl(__epoll, EPOLL_CTL_DEL, h.fd, nullptr);
+
+                __handlers.erase(it);
+            }
+
+            else if (!existed) {
+                // A handler the epoll set never took must not linger in the map.
+                if (::epoll_ctl(__epoll, EPOLL_CTL_ADD, h.fd, &ev) == -1) {
+                    std::string error = strerror(errno);
+
+                    __handlers.erase(it);
+
+                    throw std::runtime_error(std::string(call) + "(): Unable to update epoll set: " + error);
+                }
+
+                return;
+            }
+
+            else status = ::epoll_ctl(__epoll, EPOLL_CTL_MOD, h.fd, &ev);
+
+            if (status == -1 && !(errno == EBADF || errno == ENOENT)) throw std::runtime_error(std::string(call) + "(): Unable to update epoll set: " + std::string(strerror(errno)));
+        }
+
+        libsocket::utils::event::callback find(int32_t id, libsocket::utils::event::callback libsocket::utils::event::handler::* slot) {
+            std::unique_lock lock(__mtx);
+
+            auto it = __handlers.find(id);
+
+            return it == __handlers.end() ? nullptr : it->second.*slot;
+        }
+
+        libsocket::utils::event::callback find_fd(fd_t fd) {
+            std::unique_lock lock(__mtx);
+
+            auto it = __fd_handlers.find(fd);
+
+            return it == __fd_handlers.end() ? nullptr : it->second;
+        }
+
+        // Milliseconds until the earliest timer, capped by `timeout_ms` (-1 means none).
+        int32_t next_timeout(int32_t timeout_ms) {
+            std::unique_lock lock(__mtx);
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+            for (auto& [id, t] : __timers) {
+                int64_t left = std::chrono::ceil<std::chrono::milliseconds>(t.deadline - now).count();
+
+                if (left < 0) left = 0;
+                if (timeout_ms < 0 || left < timeout_ms) timeout_ms = left;
+            }
+
+            return timeout_ms;
+        }
+
+        // Fires each timer that is due on entry once and re-arms it; one whose callback overruns
+        // its interval waits for the next turn, so timers never keep the loop from epoll_wait().
+        int32_t run_timers() {
+            std::vector<uint64_t> due;
+
+            {
+                std::unique_lock lock(__mtx);
+
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+                for (auto& [id, t] : __timers) {
+                    if (t.deadline > now) continue;
+
+                    t.deadline = now + t.interval;
+                    due.push_back(id);
+                }
+            }
+
+            int32_t fired = 0;
+
+            for (uint64_t id : due) {
+                libsocket::utils::event::callback fn;
+
+                {
+                    std::unique_lock lock(__mtx);
+
+                    auto it = __timers.find(id);
+
+                    // Cancelled by a callback that ran before it.
+                    if (it == __timers.end()) continue;
+
+                    fn = it->second.fn;
+                }
+
+                (*fn)();
+                fired++;
+            }
+
+            return fired;
+        }
+
+        void wake() {
+            uint64_t one = 1;
+
+            [[maybe_unused]] ssize_t status = ::write(__wakeup, &one, sizeof(one));
+        }
+    public:
+        event_loop() {
+            __epoll = ::epoll_create1(EPOLL_CLOEXEC);
+
+            if (__epoll == -1) throw std::runtime_error("event_loop(): Unable to create epoll instance: " + std::string(strerror(errno)));
+
+            __wakeup = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.u64 = libsocket::utils::event::wakeup_key;
+
+            if (__wakeup == -1 || ::epoll_ctl(__epoll, EPOLL_CTL_ADD, __wakeup, &ev) == -1) {
+                std::string error = strerror(errno);
+
+                if (__wakeup != -1) ::close(__wakeup);
+                ::close(__epoll);
+
+                throw std::runtime_error("event_loop(): Unable to create wakeup eventfd: " + error);
+            }
+        }
+
+        event_loop(const event_loop&) = delete;
+        event_loop& operator=(const event_loop&) = delete;
+
+        ~event_loop() {
+            ::close(__wakeup);
+            ::close(__epoll);
+        }
+
+        // An empty callback removes the handler.
+        void on_readable(descriptor desc, std::function<void()> cb) {
+            update(desc, &libsocket::utils::event::handler::on_read, std::move(cb), "event_loop::on_readable");
+        }
+
+        void on_writable(descriptor desc, std::function<void()> cb) {
+            update(desc, &libsocket::utils::event::handler::on_write, std::move(cb), "event_loop::on_writable");
+        }
+
+        // Watches a raw fd that has no descriptor, e.g. an OpenSSL async fd, for readability.
+        // The fd stays owned by the caller; an empty callback removes it.
+        void on_fd_readable(fd_t fd, std::function<void()> cb) {
+            std::unique_lock lock(__mtx);
+
+            auto it = __fd_handlers.find(fd);
+
+            if (!cb) {
+                if (it == __fd_handlers.end()) return;
+
+                ::epoll_ctl(__epoll, EPOLL_CTL_DEL, fd, nullptr);
+                __fd_handlers.erase(it);
+
+                return;
+            }
+
+            if (it == __fd_handlers.end()) {
+                epoll_event ev{};
+                ev.events = EPOLLIN;
+                ev.data.u64 = libsocket::utils::event::fd_key | static_cast<uint32_t>(fd);
+
+                if (::epoll_ctl(__epoll, EPOLL_CTL_ADD, fd, &ev) == -1) throw std::runtime_error("event_loop::on_fd_readable(): Unable to update epoll set: " + std::string(strerror(errno)));
+            }
+
+            __fd_handlers[fd] = std::make_shared<std::function<void()>>(std::move(cb));
+        }
+
+        void remove(descriptor desc) {
+            std::unique_lock lock(__mtx);
+
+            auto it = __handlers.find(desc.id);
+
+            if (it == __handlers.end()) return;
+
+            ::epoll_ctl(__epoll, EPOLL_CTL_DEL, it->second.fd, nullptr);
+
+            __handlers.erase(it);
+        }
+
+        bool watching(descriptor desc) {
+            std::unique_lock lock(__mtx);
+
+            return __handlers.count(desc.id);
+        }
+
+        // Runs `fn` on the loop thread; safe to call from any thread.
+        void post(std::function<void()> fn) {
+            {
+                std::unique_lock lock(__mtx);
+
+                __posted.push_back(std::move(fn));
+            }
+
+            wake();
+        }
+
+        // Calls `fn` on the loop thread every `interval_ms` until cancel(); returns the timer id.
+        uint64_t every(int32_t interval_ms, std::function<void()> fn) {
+            if (interval_ms <= 0) throw std::runtime_error("event_loop::every(): Interval must be positive");
+
+            uint64_t id;
+
+            {
+                std::unique_lock lock(__mtx);
+
+                id = __next_timer++;
+
+                std::chrono::milliseconds interval(interval_ms);
+
+                __timers[id] = {std::chrono::steady_clock::now() + interval, interval, std::make_shared<std::function<void()>>(std::move(fn))};
+            }
+
+            wake();
+
+            return id;
+        }
+
+        void cancel(uint64_t timer) {
+            std::unique_lock lock(__mtx);
+
+            __timers.erase(timer);
+        }
+
+        // Waits up to `timeout_ms` (-1 blocks) and dispatches ready callbacks and due timers;
+        // returns the number of events and timers handled.
+        int32_t run_once(int32_t timeout_ms = -1) {
+            epoll_event events[libsocket::utils::event::max_events];
+
+            int32_t count = ::epoll_wait(__epoll, events, libsocket::utils::event::max_events, next_timeout(timeout_ms));
+
+            if (count == -1) {
+                if (errno == EINTR) return run_timers();
+
+                throw std::runtime_error("event_loop::run_once(): Unable to wait for events: " + std::string(strerror(errno)));
+            }
+
+            for (int32_t i = 0; i < count; i++) {
+                if (events[i].data.u64 == libsocket::utils::event::wakeup_key) {
+                    uint64_t value;
+
+                    [[maybe_unused]] ssize_t status = ::read(__wakeup, &value, sizeof(value));
+
+                    std::vector<std::function<void()>> posted;
+
+                    {
+                        std::unique_lock lock(__mtx);
+
+                        posted.swap(__posted);
+                    }
+
+                    for (std::function<void()>& fn : posted) fn();
+
+                    continue;
+                }
+
+                if (events[i].data.u64 & libsocket::utils::event::fd_key) {
+                    if (libsocket::utils::event::callback cb = find_fd(static_cast<fd_t>(static_cast<uint32_t>(events[i].data.u64)))) (*cb)();
+
+                    continue;
+                }
+
+                int32_t id = static_cast<int32_t>(events[i].data.u64);
+                uint32_t ready = events[i].events;
+
+                if (ready & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    if (libsocket::utils::event::callback cb = find(id, &libsocket::utils::event::handler::on_read)) (*cb)();
+                }
+
+                if (ready & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                    if (libsocket::utils::event::callback cb = find(id, &libsocket::utils::event::handler::on_write)) (*cb)();
+                }
+            }
+
+            return count + run_timers();
+        }
+
+        void run() {
+            __running = true;
+
+            while (__running) run_once();
+        }
+
+        void stop() {
+            __running = false;
+
+            wake();
+        }
+    };
+
+    namespace utils::event {
+        constexpr int32_t accept_backoff_ms = 100;
+
+        // Accepts every pending connection on `listener` each time `loop` sees it readable and
+        // hands it to `fn`. Other errors than EAGAIN (EMFILE, ENFILE, ENOBUFS) are passed to
+        // `on_error` and park the listener for accept_backoff_ms: it stays readable, so
+        // retrying at once would spin.
+        void accept_all(libsocket::event_loop& loop, descriptor listener, std::function<void(descriptor)> fn, std::function<void()> on_error) {
+            loop.on_readable(listener, [&loop, listener, fn, on_error] {
+                while (true) {
+                    descriptor client;
+
+                    try { client = libsocket::accept(listener); }
+
+                    catch (const std::runtime_error&) {
+                        int32_t error = errno;
+
+                        if (error == EAGAIN || error == EWOULDBLOCK || !libsocket::utils::descriptor_ok(listener)) return;
+
+                        if (on_error) on_error();
+
+                        loop.on_readable(listener, nullptr);
+
+                        // Runs on this thread, so the id is stored before the timer can fire.
+                        auto timer = std::make_shared<uint64_t>();
+
+                        *timer = loop.every(accept_backoff_ms, [&loop, listener, fn, on_error, timer] {
+                            loop.cancel(*timer);
+
+                            try { accept_all(loop, listener, fn, on_error); }
+                            catch (const std::runtime_error&) {}
+                        });
+
+                        return;
+                    }
+
+                    fn(client);
+                }
+            });
+        }
+    }
+}
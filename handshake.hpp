@@ -0,0 +1,475 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <utility>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <stdexcept>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "def.hpp"
+#include "socket.hpp"
+#include "common.hpp"
+#include "utils.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+#include "ssl.hpp"
+#include "event.hpp"
+
+namespace libsocket {
+    struct handshake_policy {
+        size_t threads = 2;
+        size_t max_pending = 1024;      // queued plus in-progress; beyond it submit() refuses
+        int32_t timeout_ms = 10000;
+        bool async = false;             // SSL_MODE_ASYNC, for engines/providers that offload crypto
+    };
+
+    // `failed` includes `timed_out`; `per_sec` is the completion rate since the previous stats().
+    // `accept_errors` counts serve() accept failures other than EAGAIN, each followed by a pause.
+    struct handshake_stats {
+        uint64_t completed;
+        uint64_t failed;
+        uint64_t timed_out;
+        uint64_t rejected;
+        uint64_t accept_errors;
+        uint64_t pending;
+        double per_sec;
+    };
+
+    namespace utils::handshake {
+        constexpr int32_t sweep_ms = 100;
+
+        using callback = std::function<void(descriptor, bool)>;
+
+        enum class progress {
+            done,
+            want_read,
+            want_write,
+            want_async,
+            failed
+        };
+
+        struct job {
+            descriptor desc;
+            size_t worker;
+            bool blocking;
+            bool finished = false;
+            bool retry = false;                         // paused in OpenSSL with no fd to wait on
+
+            std::vector<OSSL_ASYNC_FD> async_fds;       // what the paused job waits on
+
+            std::chrono::steady_clock::time_point start;
+            std::chrono::steady_clock::time_point deadline;
+
+            callback done;
+        };
+
+        using job_ptr = std::shared_ptr<job>;
+
+        // `jobs` and `parked` are only touched on the worker's own loop thread.
+        struct worker {
+            libsocket::event_loop loop;
+            std::map<int32_t, job_ptr> jobs;
+            std::map<OSSL_ASYNC_FD, std::vector<job_ptr>> parked;
+            std::thread thread;
+        };
+
+        // One of the `max_pending` admission slots, given back on destruction unless a job
+        // took it over with release().
+        class slot {
+            std::atomic<uint64_t>* __pending = nullptr;
+        public:
+            slot() = default;
+            slot(std::atomic<uint64_t>* pending) : __pending(pending) {}
+            slot(slot&& other) : __pending(std::exchange(other.__pending, nullptr)) {}
+
+            slot(const slot&) = delete;
+            slot& operator=(const slot&) = delete;
+
+            ~slot() {
+                if (__pending) (*__pending)--;
+            }
+
+            explicit operator bool() const {
+                return __pending;
+            }
+
+            void release() {
+                __pending = nullptr;
+            }
+        };
+
+        std::vector<OSSL_ASYNC_FD> async_fds(ssl_conn ssl) {
+            size_t count = 0;
+
+            if (!SSL_get_all_async_fds(ssl, nullptr, &count) || !count) return {};
+
+            std::vector<OSSL_ASYNC_FD> fds(count);
+
+            if (!SSL_get_all_async_fds(ssl, fds.data(), &count)) return {};
+
+            fds.resize(count);
+
+            return fds;
+        }
+
+        // One non-blocking SSL_accept()/SSL_connect() call under the descriptor's locks.
+        progress step(job& j) {
+            libsocket::trace::scope span(libsocket::trace::event::handshake, j.desc.id);
+
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(j.desc)) return progress::failed;
+
+            libsocket::utils::socket& sock = socket_table.at(j.desc.id);
+            ssl_conn ssl = ssl_conn_table.at(j.desc.id);
+
+            libsocket::utils::pin pin(sock);
+            lock.unlock();
+
+            std::unique_lock recv_lock = libsocket::utils::lock_socket(j.desc, sock, sock.recvMtx);
+            std::unique_lock send_lock = libsocket::utils::lock_socket(j.desc, sock, sock.sendMtx);
+            std::unique_lock ssl_lock(sock.sslMtx);
+
+            int32_t status = sock.accepted ? SSL_accept(ssl) : SSL_connect(ssl);
+
+            if (status == 1) {
+                libsocket::utils::count(sock, &libsocket::stats::counters::handshakes, 1);
+                libsocket::utils::count(sock, &libsocket::stats::counters::handshake_ns, libsocket::stats::elapsed_ns(j.start));
+
+                return progress::done;
+            }
+
+            switch (SSL_get_error(ssl, status)) {
+                case SSL_ERROR_WANT_READ: return progress::want_read;
+                case SSL_ERROR_WANT_WRITE: return progress::want_write;
+                case SSL_ERROR_WANT_ASYNC:
+                case SSL_ERROR_WANT_ASYNC_JOB:
+                    j.async_fds = libsocket::utils::handshake::async_fds(ssl);
+
+                    return progress::want_async;
+            }
+
+            ERR_clear_error();
+            libsocket::utils::count(sock, &libsocket::stats::counters::errors, 1);
+
+            return progress::failed;
+        }
+    }
+
+    // Runs TLS handshakes on a few dedicated threads so key exchange never stalls the accept
+    // loop or established traffic. Handshakes are driven non-blocking, many per thread, and
+    // `done(desc, ok)` is called on a pool thread once each one ends; from there hand the
+    // descriptor back to the I/O side, e.g. worker_pool::add() or event_loop::post(). On
+    // failure the descriptor is left open with its ssl:: state, for ssl::shutdown() and close().
+    // Handshakes still in flight at stop() fail, and are reported on the stopping thread.
+    class handshake_pool {
+        handshake_policy __policy;
+        std::vector<std::unique_ptr<libsocket::utils::handshake::worker>> __workers;
+        std::atomic<size_t> __next = 0;
+        std::atomic_bool __running = true;
+
+        std::atomic<uint64_t> __pending{0};
+        std::atomic<uint64_t> __completed{0};
+        std::atomic<uint64_t> __failed{0};
+        std::atomic<uint64_t> __timed_out{0};
+        std::atomic<uint64_t> __rejected{0};
+        std::atomic<uint64_t> __accept_errors{0};
+
+        std::mutex __rate_mtx;
+        std::chrono::steady_clock::time_point __rate_since = std::chrono::steady_clock::now();
+        uint64_t __rate_completed = 0;
+
+        // Admission control: an empty slot means `max_pending` is reached or the pool stopped.
+        libsocket::utils::handshake::slot reserve() {
+            uint64_t count = __pending.fetch_add(1);
+            libsocket::utils::handshake::slot reserved(&__pending);
+
+            if (count < __policy.max_pending && __running) return reserved;
+
+            __rejected++;
+
+            return {};
+        }
+
+        // Takes a job off every async fd it waits on, unwatching fds nobody else waits on.
+        void unpark(libsocket::utils::handshake::worker& w, const libsocket::utils::handshake::job_ptr& j) {
+            for (OSSL_ASYNC_FD fd : j->async_fds) {
+                auto it = w.parked.find(fd);
+
+                if (it == w.parked.end()) continue;
+
+                std::vector<libsocket::utils::handshake::job_ptr>& jobs = it->second;
+
+                jobs.erase(std::remove(jobs.begin(), jobs.end(), j), jobs.end());
+
+                if (jobs.empty()) {
+                    w.loop.on_fd_readable(fd, nullptr);
+                    w.parked.erase(it);
+                }
+            }
+
+            j->async_fds.clear();
+            j->retry = false;
+        }
+
+        // Waits for a job paused inside OpenSSL to become resumable. Engines that expose no fd
+        // are retried by the next sweep rather than spun on.
+        void park(libsocket::utils::handshake::job_ptr j) {
+            libsocket::utils::handshake::worker& w = *__workers[j->worker];
+
+            w.loop.on_readable(j->desc, nullptr);
+            w.loop.on_writable(j->desc, nullptr);
+
+            if (j->async_fds.empty()) {
+                j->retry = true;
+
+                return;
+            }
+
+            for (OSSL_ASYNC_FD fd : j->async_fds) {
+                std::vector<libsocket::utils::handshake::job_ptr>& jobs = w.parked[fd];
+
+                if (jobs.empty()) w.loop.on_fd_readable(fd, [this, &w, fd] { resume(w, fd); });
+
+                jobs.push_back(j);
+            }
+        }
+
+        void resume(libsocket::utils::handshake::worker& w, OSSL_ASYNC_FD fd) {
+            auto it = w.parked.find(fd);
+
+            if (it == w.parked.end()) return;
+
+            std::vector<libsocket::utils::handshake::job_ptr> jobs = it->second;
+
+            for (libsocket::utils::handshake::job_ptr& j : jobs) advance(j);
+        }
+
+        void finish(libsocket::utils::handshake::job_ptr j, bool ok) {
+            if (j->finished) return;
+
+            j->finished = true;
+
+            libsocket::utils::handshake::worker& w = *__workers[j->worker];
+
+            unpark(w, j);
+            w.loop.remove(j->desc);
+            w.jobs.erase(j->desc.id);
+
+            try { libsocket::utils::set_blocking(j->desc, j->blocking); }
+            catch (const std::runtime_error&) {}
+
+            (ok ? __completed : __failed)++;
+            __pending--;
+
+            if (j->done) j->done(j->desc, ok);
+        }
+
+        void advance(libsocket::utils::handshake::job_ptr j) {
+            if (j->finished) return;
+            if (!__running) return finish(j, false);
+
+            libsocket::utils::handshake::worker& w = *__workers[j->worker];
+
+            try {
+                unpark(w, j);
+
+                switch (libsocket::utils::handshake::step(*j)) {
+                    case libsocket::utils::handshake::progress::done: return finish(j, true);
+                    case libsocket::utils::handshake::progress::failed: return finish(j, false);
+
+                    case libsocket::utils::handshake::progress::want_read:
+                        w.loop.on_writable(j->desc, nullptr);
+                        w.loop.on_readable(j->desc, [this, j] { advance(j); });
+
+                        return;
+
+                    case libsocket::utils::handshake::progress::want_write:
+                        w.loop.on_readable(j->desc, nullptr);
+                        w.loop.on_writable(j->desc, [this, j] { advance(j); });
+
+                        return;
+
+                    case libsocket::utils::handshake::progress::want_async: return park(j);
+                }
+            }
+
+            catch (const std::exception&) {
+                finish(j, false);
+            }
+        }
+
+        void sweep(size_t index) {
+            libsocket::utils::handshake::worker& w = *__workers[index];
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            std::vector<libsocket::utils::handshake::job_ptr> expired;
+            std::vector<libsocket::utils::handshake::job_ptr> retry;
+
+            for (auto& [id, j] : w.jobs) {
+                if (j->deadline <= now) expired.push_back(j);
+                else if (j->retry) retry.push_back(j);
+            }
+
+            for (libsocket::utils::handshake::job_ptr& j : expired) {
+                __timed_out++;
+
+                finish(j, false);
+            }
+
+            for (libsocket::utils::handshake::job_ptr& j : retry) advance(j);
+        }
+
+        // On success the job owns `reserved`; on a throw it is still the caller's to drop.
+        void start(descriptor desc, libsocket::utils::handshake::callback done, libsocket::utils::handshake::slot& reserved) {
+            auto j = std::make_shared<libsocket::utils::handshake::job>();
+
+            j->desc = desc;
+            j->done = std::move(done);
+            j->start = std::chrono::steady_clock::now();
+            j->deadline = j->start + std::chrono::milliseconds(__policy.timeout_ms);
+            j->worker = __next++ % __workers.size();
+
+            {
+                std::unique_lock lock = libsocket::utils::lock_table();
+
+                if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("handshake_pool::submit(): socket closed");
+
+                auto it = ssl_conn_table.find(desc.id);
+
+                if (it == ssl_conn_table.end()) throw std::runtime_error("handshake_pool::submit(): ssl::enable() was not called");
+                if (__policy.async) SSL_set_mode(it->second, SSL_MODE_ASYNC);
+
+                j->blocking = socket_table.at(desc.id).blocking;
+            }
+
+            libsocket::utils::set_blocking(desc, false);
+
+            libsocket::utils::handshake::worker& w = *__workers[j->worker];
+
+            reserved.release();
+
+            w.loop.post([this, j, &w] {
+                w.jobs[j->desc.id] = j;
+
+                advance(j);
+            });
+        }
+    public:
+        handshake_pool(handshake_policy policy = {}) : __policy(policy) {
+            if (!__policy.threads) __policy.threads = 1;
+
+            for (size_t i = 0; i < __policy.threads; i++) __workers.push_back(std::make_unique<libsocket::utils::handshake::worker>());
+
+            for (size_t i = 0; i < __policy.threads; i++) {
+                libsocket::utils::handshake::worker& w = *__workers[i];
+
+                w.loop.every(std::min(libsocket::utils::handshake::sweep_ms, std::max(__policy.timeout_ms, 1)), [this, i] { sweep(i); });
+                w.thread = std::thread([this, &w] { while (__running) w.loop.run_once(); });
+            }
+        }
+
+        handshake_pool(const handshake_pool&) = delete;
+        handshake_pool& operator=(const handshake_pool&) = delete;
+
+        ~handshake_pool() {
+            stop();
+        }
+
+        // Queues the handshake of an ssl::enable()d descriptor. Returns false, leaving `desc`
+        // untouched, when `max_pending` handshakes are already in flight.
+        bool submit(descriptor desc, std::function<void(descriptor, bool)> done) {
+            libsocket::utils::handshake::slot reserved = reserve();
+
+            if (!reserved) return false;
+
+            start(desc, std::move(done), reserved);
+
+            return true;
+        }
+
+        // Accepts on a pool thread, enables TLS with `ctx` and submits every new connection.
+        // Connections over the admission limit are closed before any TLS work is spent on them.
+        void serve(descriptor listener, ssl_ctx ctx, std::function<void(descriptor, bool)> done) {
+            libsocket::utils::set_blocking(listener, false);
+
+            libsocket::utils::event::accept_all(__workers[0]->loop, listener, [this, ctx, done](descriptor client) {
+                libsocket::utils::handshake::slot reserved = reserve();
+
+                if (!reserved) {
+                    libsocket::close(client);
+
+                    return;
+                }
+
+                try { libsocket::ssl::enable(client, ctx); }
+
+                catch (const std::runtime_error&) {
+                    libsocket::close(client);
+
+                    return;
+                }
+
+                try { start(client, done, reserved); }
+
+                // Frees the SSL object enable() made; there is no handshake to close.
+                catch (const std::runtime_error&) {
+                    try { libsocket::ssl::shutdown(client); }
+                    catch (const std::runtime_error&) {}
+
+                    ERR_clear_error();
+                    libsocket::close(client);
+                }
+            }, [this] { __accept_errors++; });
+        }
+
+        handshake_stats stats() {
+            std::unique_lock lock(__rate_mtx);
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            uint64_t completed = __completed;
+            double seconds = std::chrono::duration<double>(now - __rate_since).count();
+            double rate = seconds > 0 ? (completed - __rate_completed) / seconds : 0;
+
+            __rate_since = now;
+            __rate_completed = completed;
+
+            return {completed, __failed, __timed_out, __rejected, __accept_errors, __pending, rate};
+        }
+
+        size_t pending() const {
+            return __pending;
+        }
+
+        // Joins the threads, then fails every handshake still in flight or queued: each gets
+        // its blocking mode back and `done(desc, false)`.
+        void stop() {
+            if (!__running.exchange(false)) return;
+
+            for (auto& w : __workers) w->loop.post([] {});
+            for (auto& w : __workers) if (w->thread.joinable()) w->thread.join();
+
+            // A submit() that reserved before seeing the stop still posts its job; wait it out.
+            while (__pending) {
+                for (auto& w : __workers) {
+                    w->loop.run_once(0);
+
+                    std::vector<libsocket::utils::handshake::job_ptr> left;
+
+                    for (auto& [id, j] : w->jobs) left.push_back(j);
+                    for (libsocket::utils::handshake::job_ptr& j : left) finish(j, false);
+                }
+
+                if (__pending) std::this_thread::yield();
+            }
+        }
+    };
+}
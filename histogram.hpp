@@ -0,0 +1,79 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+namespace libsocket {
+    // Log-linear histogram in the spirit of HdrHistogram: values below 2^precision are
+    // recorded exactly, larger values keep `precision` significant bits (~1% error at 7).
+    class histogram {
+        static constexpr uint32_t precision = 7;
+        static constexpr uint64_t linear = uint64_t(1) << precision;
+        static constexpr uint64_t half = linear >> 1;
+
+        std::vector<uint64_t> __buckets;
+
+        uint64_t __count = 0;
+        uint64_t __sum = 0;
+        uint64_t __min = UINT64_MAX;
+        uint64_t __max = 0;
+
+        static uint32_t index(uint64_t value) {
+            if (value < linear) return value;
+
+            uint32_t exponent = 63 - __builtin_clzll(value);
+            uint64_t mantissa = value >> (exponent - precision + 1);
+
+            return linear + (exponent - precision) * half + (mantissa - half);
+        }
+
+        static uint64_t lower_bound(uint32_t idx) {
+            if (idx < linear) return idx;
+
+            uint32_t exponent = (idx - linear) / half + precision;
+            uint64_t mantissa = (idx - linear) % half + half;
+
+            return mantissa << (exponent - precision + 1);
+        }
+    public:
+        histogram() : __buckets(linear + (64 - precision) * half, 0) {}
+
+        void record(uint64_t value) {
+            __buckets[index(value)]++;
+
+            __count++;
+            __sum += value;
+            __min = std::min(__min, value);
+            __max = std::max(__max, value);
+        }
+
+        void merge(const histogram& other) {
+            for (size_t i = 0; i < __buckets.size(); i++) __buckets[i] += other.__buckets[i];
+
+            __count += other.__count;
+            __sum += other.__sum;
+            __min = std::min(__min, other.__min);
+            __max = std::max(__max, other.__max);
+        }
+
+        uint64_t percentile(double q) const {
+            if (!__count) return 0;
+
+            uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q / 100.0 * __count + 0.5));
+            uint64_t seen = 0;
+
+            for (size_t i = 0; i < __buckets.size(); i++) {
+                seen += __buckets[i];
+
+                if (seen >= rank) return std::min(std::max(lower_bound(i), __min), __max);
+            }
+
+            return __max;
+        }
+
+        uint64_t count() const { return __count; }
+        uint64_t min() const { return __count ? __min : 0; }
+        uint64_t max() const { return __max; }
+        uint64_t mean() const { return __count ? __sum / __count : 0; }
+    };
+}
@@ -0,0 +1,256 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+#include <endian.h>
+#include <poll.h>
+
+#include "def.hpp"
+#include "socket.hpp"
+#include "common.hpp"
+#include "ssl.hpp"
+#include "utils.hpp"
+
+namespace libsocket {
+    namespace utils::pipeline {
+        // Frame on the wire: big-endian payload size and correlation id, then the payload.
+        constexpr size_t header_size = 12;
+        constexpr int64_t read_chunk = 1 << 16;
+        constexpr int32_t poll_interval_ms = 100;
+        constexpr uint32_t max_frame = 64 << 20;
+
+        std::vector<int8_t> frame(uint64_t id, const std::vector<int8_t>& payload) {
+            if (payload.size() > max_frame) throw std::runtime_error("pipeline: Frame too large");
+
+            std::vector<int8_t> buffer(header_size + payload.size());
+
+            uint32_t size = htobe32(payload.size());
+            uint64_t tag = htobe64(id);
+
+            std::memcpy(buffer.data(), &size, sizeof(size));
+            std::memcpy(buffer.data() + sizeof(size), &tag, sizeof(tag));
+            std::copy(payload.begin(), payload.end(), buffer.begin() + header_size);
+
+            return buffer;
+        }
+
+        // Pops every complete frame from the front of `buffer`.
+        void parse(std::vector<int8_t>& buffer, std::function<void(uint64_t, std::vector<int8_t>)> on_frame) {
+            size_t offset = 0;
+
+            while (buffer.size() - offset >= header_size) {
+                uint32_t size;
+                uint64_t id;
+
+                std::memcpy(&size, buffer.data() + offset, sizeof(size));
+                std::memcpy(&id, buffer.data() + offset + sizeof(size), sizeof(id));
+
+                size = be32toh(size);
+                id = be64toh(id);
+
+                if (size > max_frame) throw std::runtime_error("pipeline: Frame too large");
+                if (buffer.size() - offset - header_size < size) break;
+
+                auto begin = buffer.begin() + offset + header_size;
+
+                on_frame(id, std::vector<int8_t>(begin, begin + size));
+
+                offset += header_size + size;
+            }
+
+            buffer.erase(buffer.begin(), buffer.begin() + offset);
+        }
+
+        void write_all(descriptor desc, const std::vector<int8_t>& buffer, bool tls) {
+            size_t sent = 0;
+
+            while (sent < buffer.size()) {
+                const int8_t* data = buffer.data() + sent;
+                size_t size = buffer.size() - sent;
+                int64_t n = tls ? libsocket::ssl::write(desc, data, size) : libsocket::write(desc, data, size, MSG_NOSIGNAL);
+
+                if (n <= 0) throw std::runtime_error("pipeline: Unable to write frame");
+
+                sent += n;
+            }
+        }
+
+        // Returns an empty buffer on timeout; throws once the connection is closed. Waits only
+        // in poll() and never inside a read, so close() is noticed within poll_interval_ms.
+        std::vector<int8_t> read_some(descriptor desc, bool tls) {
+            if (!(tls && libsocket::ssl::pending(desc)) && !libsocket::utils::poll(desc, POLLIN, poll_interval_ms)) return {};
+
+            std::vector<int8_t> chunk = tls ? libsocket::ssl::read(desc, read_chunk, MSG_DONTWAIT) : libsocket::read(desc, read_chunk, MSG_DONTWAIT);
+
+            if (!chunk.empty()) return chunk;
+
+            // Nothing decrypted may just be a partial TLS record: the peer is gone once it sent
+            // close_notify, or the socket is readable with no bytes left on it.
+            if (tls && libsocket::ssl::peer_closed(desc)) throw std::runtime_error("pipeline: Connection closed");
+            if (libsocket::utils::poll(desc, POLLIN, 0) && libsocket::read(desc, 1, MSG_PEEK | MSG_DONTWAIT).empty()) throw std::runtime_error("pipeline: Connection closed");
+
+            return chunk;
+        }
+    }
+
+    // Client side of a pipelined connection: many requests in flight on one stream
+    // descriptor (plain or ssl::), each tagged with a correlation id. Responses are matched
+    // by id, so the peer may answer in any order.
+    class pipeline {
+        descriptor __desc;
+        bool __tls;
+        size_t __limit;
+
+        std::map<uint64_t, std::promise<std::vector<int8_t>>> __inflight;
+        uint64_t __next_id = 1;
+        std::string __error;
+
+        std::mutex __mtx;
+        std::mutex __write_mtx;
+        std::condition_variable __space;
+
+        std::atomic_bool __running = true;
+        std::thread __reader;
+
+        // Fails every outstanding request; the first reason sticks.
+        void fail(std::string reason) {
+            std::unique_lock lock(__mtx);
+
+            if (__error.empty()) __error = reason;
+
+            for (auto& [id, promise] : __inflight) promise.set_exception(std::make_exception_ptr(std::runtime_error(__error)));
+
+            __inflight.clear();
+            __space.notify_all();
+        }
+
+        void reader() {
+            std::vector<int8_t> buffer;
+
+            try {
+                while (__running) {
+                    std::vector<int8_t> chunk = libsocket::utils::pipeline::read_some(__desc, __tls);
+
+                    if (chunk.empty()) continue;
+
+                    buffer.insert(buffer.end(), chunk.begin(), chunk.end());
+
+                    libsocket::utils::pipeline::parse(buffer, [this](uint64_t id, std::vector<int8_t> payload) {
+                        std::unique_lock lock(__mtx);
+
+                        auto it = __inflight.find(id);
+
+                        if (it == __inflight.end()) return;
+
+                        it->second.set_value(std::move(payload));
+                        __inflight.erase(it);
+
+                        __space.notify_one();
+                    });
+                }
+
+                fail("pipeline: closed");
+            }
+
+            catch (const std::exception& e) {
+                fail(e.what());
+            }
+        }
+    public:
+        pipeline(descriptor desc, bool tls = false, size_t max_inflight = 128) : __desc(desc), __tls(tls), __limit(max_inflight) {
+            if (!__limit) throw std::invalid_argument("pipeline: max_inflight must be positive");
+
+            __reader = std::thread(&pipeline::reader, this);
+        }
+
+        pipeline(const pipeline&) = delete;
+        pipeline& operator=(const pipeline&) = delete;
+
+        ~pipeline() {
+            close();
+        }
+
+        // Blocks while `max_inflight` requests are outstanding. A payload above max_frame is
+        // refused here, before it could reach the peer and end the connection.
+        std::future<std::vector<int8_t>> request(std::vector<int8_t> payload) {
+            if (payload.size() > libsocket::utils::pipeline::max_frame) throw std::runtime_error("pipeline: Frame too large");
+
+            std::unique_lock lock(__mtx);
+
+            __space.wait(lock, [this] { return __inflight.size() < __limit || !__error.empty(); });
+
+            if (!__error.empty()) throw std::runtime_error(__error);
+
+            uint64_t id = __next_id++;
+            std::future<std::vector<int8_t>> result = __inflight[id].get_future();
+
+            lock.unlock();
+
+            std::unique_lock write_lock(__write_mtx);
+
+            // A failed earlier write already failed this request along with the others.
+            if (!__running) return result;
+
+            // A frame cut short leaves the stream unparseable for the peer, so one failed
+            // write ends the whole pipeline.
+            try {
+                libsocket::utils::pipeline::write_all(__desc, libsocket::utils::pipeline::frame(id, payload), __tls);
+            }
+
+            catch (const std::exception& e) {
+                __running = false;
+
+                fail(e.what());
+            }
+
+            return result;
+        }
+
+        std::future<std::vector<int8_t>> requeststring(std::string string) {
+            return request(std::vector<int8_t>(string.begin(), string.end()));
+        }
+
+        size_t inflight() {
+            std::unique_lock lock(__mtx);
+
+            return __inflight.size();
+        }
+
+        // Stops the reader and fails outstanding requests; the descriptor stays open.
+        void close() {
+            __running = false;
+
+            if (__reader.joinable()) __reader.join();
+        }
+
+        // Server side: answers every frame on `desc` with handler(payload), echoing its id.
+        // Returns when the peer closes the connection or an I/O error occurs.
+        static void serve(descriptor desc, std::function<std::vector<int8_t>(std::vector<int8_t>)> handler, bool tls = false) {
+            std::vector<int8_t> buffer;
+
+            try {
+                while (true) {
+                    std::vector<int8_t> chunk = libsocket::utils::pipeline::read_some(desc, tls);
+
+                    buffer.insert(buffer.end(), chunk.begin(), chunk.end());
+
+                    libsocket::utils::pipeline::parse(buffer, [&](uint64_t id, std::vector<int8_t> payload) {
+                        libsocket::utils::pipeline::write_all(desc, libsocket::utils::pipeline::frame(id, handler(std::move(payload))), tls);
+                    });
+                }
+            }
+
+            catch (const std::runtime_error&) {}
+        }
+    };
+}
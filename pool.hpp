@@ -0,0 +1,282 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <stdexcept>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "def.hpp"
+#include "socket.hpp"
+#include "common.hpp"
+#include "utils.hpp"
+#include "event.hpp"
+
+namespace libsocket {
+    // `failed` counts handler exceptions; those descriptors are closed by the pool.
+    // `accept_errors` counts serve() accept failures other than EAGAIN (worker 0 only).
+    struct worker_stats {
+        uint64_t handled;
+        uint64_t stolen;
+        uint64_t failed;
+        uint64_t accept_errors;
+    };
+
+    namespace utils::pool {
+        using handler = std::function<bool(descriptor)>;
+
+        struct connection {
+            descriptor desc;
+            size_t owner;
+            handler fn;
+        };
+
+        using task = std::shared_ptr<connection>;
+
+        // The owner pushes and pops at the back, thieves take from the front, so a stolen
+        // task is the oldest one and the owner keeps working on what is hot in its cache.
+        struct worker {
+            libsocket::event_loop loop;
+
+            std::deque<task> tasks;
+            std::mutex mtx;
+
+            std::atomic_bool sleeping = false;
+            std::atomic<uint64_t> handled{0};
+            std::atomic<uint64_t> stolen{0};
+            std::atomic<uint64_t> failed{0};
+            std::atomic<uint64_t> accept_errors{0};
+
+            std::thread thread;
+        };
+
+        // CPUs the process may run on, which under a cpuset or taskset is not 0..N-1.
+        std::vector<int32_t> allowed_cpus() {
+            cpu_set_t set;
+            std::vector<int32_t> cpus;
+
+            if (::sched_getaffinity(0, sizeof(set), &set) == -1) throw std::runtime_error("worker_pool(): Unable to get CPU affinity: " + std::string(strerror(errno)));
+
+            for (int32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+            }
+
+            return cpus;
+        }
+
+        void pin(std::thread& thread, int32_t cpu) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+
+            int32_t status = ::pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+
+            if (status) throw std::runtime_error("worker_pool(): Unable to pin worker to CPU " + std::to_string(cpu) + ": " + std::string(strerror(status)));
+        }
+    }
+
+    // Server runtime with one event loop per worker thread. A connection is owned by one
+    // worker, whose loop watches it; when it becomes readable a task is queued on that
+    // worker's deque, and idle workers steal queued tasks so slow handlers (TLS, parsing)
+    // spread across cores. The handler returns false once it is done with the descriptor;
+    // closing it is up to the handler.
+    class worker_pool {
+        std::vector<std::unique_ptr<libsocket::utils::pool::worker>> __workers;
+        std::atomic<size_t> __next = 0;
+        std::atomic_bool __running = true;
+
+        void arm(libsocket::utils::pool::task conn) {
+            __workers[conn->owner]->loop.on_readable(conn->desc, [this, conn] { ready(conn); });
+        }
+
+        // Runs on the owner's loop: the descriptor is disarmed until its task has run, so a
+        // connection is never handled by two workers at once.
+        void ready(libsocket::utils::pool::task conn) {
+            libsocket::utils::pool::worker& owner = *__workers[conn->owner];
+
+            owner.loop.on_readable(conn->desc, nullptr);
+
+            size_t queued;
+
+            {
+                std::unique_lock lock(owner.mtx);
+
+                owner.tasks.push_back(conn);
+                queued = owner.tasks.size();
+            }
+
+            if (queued > 1) wake_idle(conn->owner);
+        }
+
+        void wake_idle(size_t except) {
+            for (size_t i = 0; i < __workers.size(); i++) {
+                if (i == except || !__workers[i]->sleeping) continue;
+
+                __workers[i]->loop.post([] {});
+
+                return;
+            }
+        }
+
+        libsocket::utils::pool::task next(size_t self) {
+            libsocket::utils::pool::worker& own = *__workers[self];
+
+            {
+                std::unique_lock lock(own.mtx);
+
+                if (!own.tasks.empty()) {
+                    libsocket::utils::pool::task conn = own.tasks.back();
+                    own.tasks.pop_back();
+
+                    return conn;
+                }
+            }
+
+            for (size_t i = 1; i < __workers.size(); i++) {
+                libsocket::utils::pool::worker& victim = *__workers[(self + i) % __workers.size()];
+
+                std::unique_lock lock(victim.mtx);
+
+                if (victim.tasks.empty()) continue;
+
+                libsocket::utils::pool::task conn = victim.tasks.front();
+                victim.tasks.pop_front();
+
+                own.stolen++;
+
+                return conn;
+            }
+
+            return nullptr;
+        }
+
+        // A handler that throws gives up its descriptor: it is closed rather than left open
+        // and unwatched.
+        void handle(libsocket::utils::pool::worker& own, libsocket::utils::pool::task conn) {
+            bool keep = false;
+
+            try { keep = conn->fn(conn->desc); }
+            catch (const std::exception&) {
+                own.failed++;
+
+                try { libsocket::close(conn->desc); }
+                catch (const std::runtime_error&) {}
+            }
+
+            own.handled++;
+
+            if (keep) {
+                try { arm(conn); }
+                catch (const std::runtime_error&) {}
+            }
+        }
+
+        void work(size_t self) {
+            libsocket::utils::pool::worker& own = *__workers[self];
+
+            while (__running) {
+                libsocket::utils::pool::task conn = next(self);
+
+                // Announce sleep first and look again: ready() queues under the deque mutex
+                // before it checks `sleeping`, so a task is either seen here or wakes us.
+                if (!conn) {
+                    own.sleeping = true;
+                    conn = next(self);
+                }
+
+                if (conn) {
+                    own.sleeping = false;
+
+                    handle(own, conn);
+
+                    // Keep the own loop polled while there is queued or stealable work.
+                    own.loop.run_once(0);
+
+                    continue;
+                }
+
+                own.loop.run_once();
+                own.sleeping = false;
+            }
+        }
+    public:
+        // With `pin`, worker i is bound to the i-th CPU of the process's affinity mask
+        // (wrapping around); a failure to pin stops the pool and throws.
+        worker_pool(size_t workers = std::thread::hardware_concurrency(), bool pin = true) {
+            if (!workers) workers = 1;
+
+            for (size_t i = 0; i < workers; i++) __workers.push_back(std::make_unique<libsocket::utils::pool::worker>());
+
+            std::vector<int32_t> cpus = pin ? libsocket::utils::pool::allowed_cpus() : std::vector<int32_t>{};
+
+            for (size_t i = 0; i < workers; i++) __workers[i]->thread = std::thread(&worker_pool::work, this, i);
+
+            try {
+                for (size_t i = 0; i < workers && !cpus.empty(); i++) libsocket::utils::pool::pin(__workers[i]->thread, cpus[i % cpus.size()]);
+            }
+
+            catch (const std::runtime_error&) {
+                stop();
+
+                throw;
+            }
+        }
+
+        worker_pool(const worker_pool&) = delete;
+        worker_pool& operator=(const worker_pool&) = delete;
+
+        ~worker_pool() {
+            stop();
+        }
+
+        // Hands `desc` to the next worker round-robin; `fn` runs whenever it is readable.
+        void add(descriptor desc, std::function<bool(descriptor)> fn) {
+            auto conn = std::make_shared<libsocket::utils::pool::connection>();
+
+            conn->desc = desc;
+            conn->owner = __next++ % __workers.size();
+            conn->fn = std::move(fn);
+
+            arm(conn);
+        }
+
+        // Accepts on worker 0's loop and adds every new connection with `fn`. On accept errors
+        // such as EMFILE the listener is parked for a moment and the error counted.
+        void serve(descriptor listener, std::function<bool(descriptor)> fn) {
+            libsocket::utils::set_blocking(listener, false);
+
+            libsocket::utils::pool::worker& w = *__workers[0];
+
+            libsocket::utils::event::accept_all(w.loop, listener, [this, fn](descriptor client) { add(client, fn); }, [&w] { w.accept_errors++; });
+        }
+
+        std::vector<worker_stats> stats() {
+            std::vector<worker_stats> result;
+
+            for (auto& w : __workers) result.push_back({w->handled.load(), w->stolen.load(), w->failed.load(), w->accept_errors.load()});
+
+            return result;
+        }
+
+        size_t size() const {
+            return __workers.size();
+        }
+
+        // Joins the workers; descriptors stay open and registered with no one.
+        void stop() {
+            if (!__running.exchange(false)) return;
+
+            for (auto& w : __workers) w->loop.post([] {});
+            for (auto& w : __workers) if (w->thread.joinable()) w->thread.join();
+        }
+    };
+}
@@ -0,0 +1,440 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <stdexcept>
+#include <mutex>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "def.hpp"
+#include "socket.hpp"
+#include "utils.hpp"
+#include "ssl.hpp"
+#include "event.hpp"
+
+namespace libsocket {
+    struct relay_result {
+        uint64_t a_to_b;
+        uint64_t b_to_a;
+        std::string error;
+    };
+
+    namespace utils::relay {
+        constexpr int32_t pipe_size = 1 << 18;
+        constexpr uint64_t buffer_size = 1 << 16;
+        constexpr size_t pool_max = 256;
+
+        // Copy-mode buffers are recycled across relays instead of allocated per session.
+        std::vector<std::vector<int8_t>> pool;
+        std::mutex pool_mutex;
+
+        std::vector<int8_t> acquire() {
+            std::unique_lock lock(pool_mutex);
+
+            if (pool.empty()) return std::vector<int8_t>(buffer_size);
+
+            std::vector<int8_t> buffer = std::move(pool.back());
+            pool.pop_back();
+
+            return buffer;
+        }
+
+        void release(std::vector<int8_t>&& buffer) {
+            if (buffer.empty()) return;
+
+            std::unique_lock lock(pool_mutex);
+
+            if (pool.size() < pool_max) pool.push_back(std::move(buffer));
+        }
+
+        struct direction {
+            descriptor from;
+            descriptor to;
+
+            fd_t pipe[2] = {-1, -1};
+            uint64_t capacity = 0;
+
+            std::vector<int8_t> buffer;
+            uint64_t begin = 0;
+            uint64_t end = 0;
+
+            uint64_t in_pipe = 0;
+
+            bool eof = false;
+            bool done = false;
+
+            // TLS calls that need the opposite readiness: SSL_read() on `from` waiting for
+            // it to be writable, SSL_write() on `to` waiting for it to be readable, and a
+            // close_notify on `to` that did not fit into the socket yet.
+            bool pull_wants_write = false;
+            bool push_wants_read = false;
+            bool shutdown_wants_write = false;
+
+            uint64_t bytes = 0;
+
+            uint64_t pending() const { return pipe[0] == -1 ? end - begin : in_pipe; }
+            uint64_t space() const { return pipe[0] == -1 ? buffer.size() - end : capacity - in_pipe; }
+        };
+
+        struct session {
+            libsocket::event_loop* loop;
+
+            descriptor a;
+            descriptor b;
+            bool a_blocking;
+            bool b_blocking;
+
+            // Interest currently installed on the loop for each descriptor.
+            bool a_reading = false;
+            bool a_writing = false;
+            bool b_reading = false;
+            bool b_writing = false;
+
+            direction forward;
+            direction backward;
+
+            bool copy;
+            bool finished = false;
+            std::string error;
+
+            std::function<void(relay_result)> done;
+        };
+
+        ssl_conn find_ssl(descriptor desc) {
+            auto it = ssl_conn_table.find(desc.id);
+
+            return it == ssl_conn_table.end() ? nullptr : it->second;
+        }
+
+        // Reads into the direction's pipe or buffer: >0 bytes, 0 on EOF, -1 with errno set.
+        int64_t pull(direction& d, libsocket::utils::socket& sock, ssl_conn ssl) {
+            if (d.pipe[0] != -1) return ::splice(sock.fd, nullptr, d.pipe[1], nullptr, d.space(), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (!ssl) return ::recv(sock.fd, d.buffer.data() + d.end, d.space(), MSG_DONTWAIT);
+
+            std::unique_lock ssl_lock(sock.sslMtx);
+
+            int32_t received = ::SSL_read(ssl, d.buffer.data() + d.end, d.space());
+
+            d.pull_wants_write = false;
+
+            if (received > 0) return received;
+
+            int32_t error = SSL_get_error(ssl, received);
+
+            if (error == SSL_ERROR_ZERO_RETURN) return 0;
+
+            d.pull_wants_write = error == SSL_ERROR_WANT_WRITE;
+
+            errno = error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE ? EAGAIN : EPROTO;
+
+            return -1;
+        }
+
+        int64_t push(direction& d, libsocket::utils::socket& sock, ssl_conn ssl) {
+            if (d.pipe[0] != -1) return ::splice(d.pipe[0], nullptr, sock.fd, nullptr, d.pending(), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (!ssl) return ::send(sock.fd, d.buffer.data() + d.begin, d.pending(), MSG_DONTWAIT | MSG_NOSIGNAL);
+
+            std::unique_lock ssl_lock(sock.sslMtx);
+
+            int32_t sent = ::SSL_write(ssl, d.buffer.data() + d.begin, d.pending());
+
+            d.push_wants_read = false;
+
+            if (sent > 0) return sent;
+
+            int32_t error = SSL_get_error(ssl, sent);
+
+            d.push_wants_read = error == SSL_ERROR_WANT_READ;
+
+            errno = error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE ? EAGAIN : EPIPE;
+
+            return -1;
+        }
+
+        // Moves bytes until neither side makes progress; returns false on a socket error.
+        bool pump(session& s, direction& d) {
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(d.from) || !libsocket::utils::descriptor_ok(d.to)) {
+                s.error = "socket closed";
+
+                return false;
+            }
+
+            libsocket::utils::socket& from = socket_table.at(d.from.id);
+            libsocket::utils::socket& to = socket_table.at(d.to.id);
+            ssl_conn from_ssl = find_ssl(d.from);
+            ssl_conn to_ssl = find_ssl(d.to);
+
+            libsocket::utils::pin from_pin(from);
+            libsocket::utils::pin to_pin(to);
+            lock.unlock();
+
+            std::unique_lock recv_lock = libsocket::utils::lock_socket(d.from, from, from.recvMtx);
+            std::unique_lock send_lock = libsocket::utils::lock_socket(d.to, to, to.sendMtx);
+
+            bool progress = true;
+
+            while (progress) {
+                progress = false;
+
+                if (!d.eof && d.space()) {
+                    int64_t received = pull(d, from, from_ssl);
+
+                    libsocket::utils::count_read(from, received);
+
+                    if (received > 0) {
+                        if (d.pipe[0] != -1) d.in_pipe += received;
+                        else d.end += received;
+
+                        progress = true;
+                    }
+
+                    else if (received == 0) d.eof = true;
+                    else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                        s.error = "read: " + std::string(strerror(errno));
+
+                        return false;
+                    }
+                }
+
+                if (d.pending()) {
+                    uint64_t size = d.pending();
+                    int64_t sent = push(d, to, to_ssl);
+
+                    libsocket::utils::count_write(to, sent, size);
+
+                    if (sent > 0) {
+                        if (d.pipe[0] != -1) d.in_pipe -= sent;
+                        else d.begin += sent;
+
+                        if (d.begin == d.end) d.begin = d.end = 0;
+
+                        d.bytes += sent;
+                        progress = true;
+                    }
+
+                    else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                        s.error = "write: " + std::string(strerror(errno));
+
+                        return false;
+                    }
+                }
+            }
+
+            // Half-close: forward the EOF once everything read before it has been written. The
+            // FIN waits until the close_notify is fully out, or it would cut the record short.
+            if (d.eof && !d.pending() && !d.done) {
+                if (to_ssl) {
+                    std::unique_lock ssl_lock(to.sslMtx);
+
+                    int32_t status = ::SSL_shutdown(to_ssl);
+
+                    d.shutdown_wants_write = status < 0 && SSL_get_error(to_ssl, status) == SSL_ERROR_WANT_WRITE;
+
+                    if (d.shutdown_wants_write) return true;
+                }
+
+                ::shutdown(to.fd, SHUT_WR);
+
+                d.done = true;
+            }
+
+            return true;
+        }
+
+        void finish(std::shared_ptr<session> s) {
+            if (s->finished) return;
+
+            s->finished = true;
+
+            s->loop->remove(s->a);
+            s->loop->remove(s->b);
+
+            for (direction* d : {&s->forward, &s->backward}) {
+                if (d->pipe[0] != -1) {
+                    ::close(d->pipe[0]);
+                    ::close(d->pipe[1]);
+                }
+
+                release(std::move(d->buffer));
+            }
+
+            try {
+                libsocket::utils::set_blocking(s->a, s->a_blocking);
+                libsocket::utils::set_blocking(s->b, s->b_blocking);
+            }
+
+            catch (const std::runtime_error&) {}
+
+            if (s->done) s->done({s->forward.bytes, s->backward.bytes, s->error});
+        }
+
+        void ready(std::shared_ptr<session> s, descriptor desc, bool readable);
+
+        // Readable interest only while there is room to read into, writable interest only
+        // while bytes are waiting, so the level-triggered loop never spins on a full pipe;
+        // a TLS call blocked on the opposite readiness swaps which one it waits for.
+        void watch(std::shared_ptr<session> s) {
+            for (descriptor desc : {s->a, s->b}) {
+                bool reading = false;
+                bool writing = false;
+
+                for (direction* d : {&s->forward, &s->backward}) {
+                    if (d->from.id == desc.id) {
+                        reading |= !d->eof && d->space() && !d->pull_wants_write;
+                        writing |= d->pull_wants_write;
+                    }
+
+                    if (d->to.id == desc.id) {
+                        reading |= d->push_wants_read;
+                        writing |= (d->pending() && !d->push_wants_read) || d->shutdown_wants_write;
+                    }
+                }
+
+                bool& installed_reading = desc.id == s->a.id ? s->a_reading : s->b_reading;
+                bool& installed_writing = desc.id == s->a.id ? s->a_writing : s->b_writing;
+
+                if (reading != installed_reading) {
+                    s->loop->on_readable(desc, reading ? std::function<void()>([s, desc] { ready(s, desc, true); }) : nullptr);
+                    installed_reading = reading;
+                }
+
+                if (writing != installed_writing) {
+                    s->loop->on_writable(desc, writing ? std::function<void()>([s, desc] { ready(s, desc, false); }) : nullptr);
+                    installed_writing = writing;
+                }
+            }
+        }
+
+        void settle(std::shared_ptr<session> s) {
+            watch(s);
+
+            if (s->forward.done && s->backward.done) finish(s);
+        }
+
+        // Pumps the directions a readiness event on `desc` can unblock.
+        void ready(std::shared_ptr<session> s, descriptor desc, bool readable) {
+            if (s->finished) return;
+
+            for (direction* d : {&s->forward, &s->backward}) {
+                bool wanted = readable ? (d->from.id == desc.id && !d->pull_wants_write) || (d->to.id == desc.id && d->push_wants_read)
+                                       : d->to.id == desc.id || (d->from.id == desc.id && d->pull_wants_write);
+
+                if (wanted && !pump(*s, *d)) return finish(s);
+            }
+
+            settle(s);
+        }
+
+        void step(std::shared_ptr<session> s) {
+            if (s->finished) return;
+
+            if (!pump(*s, s->forward) || !pump(*s, s->backward)) return finish(s);
+
+            settle(s);
+        }
+
+        void open(session& s, direction& d, descriptor from, descriptor to) {
+            d.from = from;
+            d.to = to;
+
+            if (s.copy) {
+                d.buffer = acquire();
+
+                return;
+            }
+
+            if (::pipe2(d.pipe, O_NONBLOCK | O_CLOEXEC) == -1) throw std::runtime_error("relay(): Unable to create pipe: " + std::string(strerror(errno)));
+
+            ::fcntl(d.pipe[1], F_SETPIPE_SZ, pipe_size);
+
+            int32_t capacity = ::fcntl(d.pipe[1], F_GETPIPE_SZ);
+
+            d.capacity = capacity > 0 ? capacity : 1 << 16;
+        }
+    }
+
+    // Forwards bytes between two connected stream descriptors on `loop` until both
+    // directions reach EOF, then calls `done` with the per-direction byte counts. Plain
+    // sockets are spliced through a kernel pipe without touching user space; if either side
+    // is an ssl:: connection, bytes are copied through pooled buffers instead. Both
+    // descriptors are switched to non-blocking mode for the duration of the relay and must
+    // not be used elsewhere until `done` runs; closing them is left to the caller.
+    void relay(event_loop& loop, descriptor a, descriptor b, std::function<void(relay_result)> done) {
+        auto s = std::make_shared<libsocket::utils::relay::session>();
+
+        s->loop = &loop;
+        s->a = a;
+        s->b = b;
+        s->done = std::move(done);
+
+        {
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(a) || !libsocket::utils::descriptor_ok(b)) throw std::runtime_error("relay(): socket closed");
+
+            s->a_blocking = socket_table.at(a.id).blocking;
+            s->b_blocking = socket_table.at(b.id).blocking;
+
+            ssl_conn ssl_a = libsocket::utils::relay::find_ssl(a);
+            ssl_conn ssl_b = libsocket::utils::relay::find_ssl(b);
+
+            s->copy = ssl_a || ssl_b;
+
+            // Retried SSL_write calls see the buffer grow, never move backwards.
+            for (ssl_conn ssl : {ssl_a, ssl_b}) {
+                if (ssl) SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+            }
+        }
+
+        try {
+            libsocket::utils::relay::open(*s, s->forward, a, b);
+            libsocket::utils::relay::open(*s, s->backward, b, a);
+
+            libsocket::utils::set_blocking(a, false);
+            libsocket::utils::set_blocking(b, false);
+        }
+
+        catch (const std::exception&) {
+            s->done = nullptr;
+
+            libsocket::utils::relay::finish(s);
+
+            throw;
+        }
+
+        // Data may already be buffered, e.g. decrypted TLS records, so pump once up front.
+        loop.post([s] { libsocket::utils::relay::step(s); });
+    }
+
+    // Blocking form: runs a private event loop until the relay completes.
+    relay_result relay(descriptor a, descriptor b) {
+        event_loop loop;
+        relay_result result{};
+
+        relay(loop, a, b, [&](relay_result r) {
+            result = r;
+
+            loop.stop();
+        });
+
+        loop.run();
+
+        if (!result.error.empty()) throw std::runtime_error("relay(): " + result.error);
+
+        return result;
+    }
+}
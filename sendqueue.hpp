@@ -0,0 +1,331 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <functional>
+#include <stdexcept>
+#include <mutex>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "def.hpp"
+#include "socket.hpp"
+#include "utils.hpp"
+#include "event.hpp"
+
+namespace libsocket {
+    namespace utils::sendqueue {
+        constexpr int32_t max_iov = 64;
+        constexpr uint64_t default_limit = 64 << 20;
+
+        struct queue {
+            descriptor desc;
+            libsocket::event_loop* loop;
+
+            uint64_t high;
+            uint64_t low;
+
+            std::function<void()> on_high;
+            std::function<void()> on_low;
+
+            std::deque<std::vector<int8_t>> chunks;
+            uint64_t offset = 0;
+            uint64_t bytes = 0;
+
+            bool above = false;
+            bool watching = false;
+            std::string error;
+
+            std::mutex mtx;
+        };
+
+        // Bytes queued across every descriptor, checked against `limit` before a write is
+        // accepted so one slow peer cannot grow the process without bound.
+        std::atomic<uint64_t> queued{0};
+        std::atomic<uint64_t> limit{default_limit};
+
+        bool reserve(uint64_t size) {
+            uint64_t current = queued.load(std::memory_order_relaxed);
+
+            do {
+                if (current + size > limit.load(std::memory_order_relaxed)) return false;
+            } while (!queued.compare_exchange_weak(current, current + size, std::memory_order_relaxed));
+
+            return true;
+        }
+
+        void consume(queue& q, uint64_t size) {
+            q.bytes -= size;
+            queued.fetch_sub(size, std::memory_order_relaxed);
+
+            while (size) {
+                uint64_t left = q.chunks.front().size() - q.offset;
+
+                if (size < left) {
+                    q.offset += size;
+
+                    break;
+                }
+
+                size -= left;
+                q.offset = 0;
+                q.chunks.pop_front();
+            }
+        }
+
+        void clear(queue& q) {
+            queued.fetch_sub(q.bytes, std::memory_order_relaxed);
+
+            q.chunks.clear();
+            q.offset = 0;
+            q.bytes = 0;
+        }
+
+        // Sends as much of the queue as the socket takes without blocking, gathering up to
+        // max_iov chunks per sendmsg(). Returns false on a socket error other than EAGAIN.
+        bool flush(descriptor desc, queue& q) {
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(desc)) {
+                q.error = "socket closed";
+
+                return false;
+            }
+
+            libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+            libsocket::utils::pin pin(sock);
+            lock.unlock();
+
+            std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.sendMtx);
+
+            while (q.bytes) {
+                iovec iov[max_iov];
+                int32_t count = 0;
+                uint64_t size = 0;
+
+                for (auto it = q.chunks.begin(); it != q.chunks.end() && count < max_iov; it++, count++) {
+                    uint64_t skip = count ? 0 : q.offset;
+
+                    iov[count].iov_base = it->data() + skip;
+                    iov[count].iov_len = it->size() - skip;
+
+                    size += iov[count].iov_len;
+                }
+
+                msghdr msg{};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = count;
+
+                int64_t sent = ::sendmsg(sock.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+                libsocket::utils::count_write(sock, sent, size);
+
+                if (sent == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+                    if (errno == EINTR) continue;
+
+                    q.error = strerror(errno);
+
+                    return false;
+                }
+
+                consume(q, sent);
+
+                if (static_cast<uint64_t>(sent) < size) return true;
+            }
+
+            return true;
+        }
+    }
+
+    using sendqueue_conn = std::shared_ptr<utils::sendqueue::queue>;
+
+    std::map<int32_t, sendqueue_conn> sendqueue_table;
+
+    namespace utils::sendqueue {
+        // close() without sendqueue::disable(): hand the queued bytes back to the process-wide
+        // budget and stop watching the fd before it goes.
+        void release(int32_t id) {
+            sendqueue_conn q;
+
+            {
+                std::unique_lock lock = libsocket::utils::lock_table();
+
+                auto it = sendqueue_table.find(id);
+
+                if (it == sendqueue_table.end()) return;
+
+                q = it->second;
+                sendqueue_table.erase(it);
+            }
+
+            std::unique_lock qlock(q->mtx);
+
+            if (q->watching) q->loop->on_writable(q->desc, nullptr);
+
+            q->watching = false;
+
+            clear(*q);
+        }
+
+        const bool release_on_close = (libsocket::utils::close_hooks.push_back(release), true);
+    }
+
+    namespace sendqueue {
+        sendqueue_conn find(descriptor desc, const char* call) {
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error(std::string(call) + "(): socket closed");
+
+            auto it = sendqueue_table.find(desc.id);
+
+            if (it == sendqueue_table.end()) throw std::runtime_error(std::string(call) + "(): Send queue not enabled");
+
+            return it->second;
+        }
+
+        // Writes queued on `desc` are drained by `loop` whenever the socket is writable.
+        // on_high fires when the queue grows past `high` bytes, on_low once it falls back to
+        // `low`, so producers can pause and resume reading from their own source.
+        void enable(descriptor desc, event_loop& loop, uint64_t high = 1 << 20, uint64_t low = 256 << 10, std::function<void()> on_high = nullptr, std::function<void()> on_low = nullptr) {
+            if (low > high) throw std::runtime_error("sendqueue::enable(): Low watermark above high watermark");
+
+            sendqueue_conn q = std::make_shared<libsocket::utils::sendqueue::queue>();
+
+            q->desc = desc;
+            q->loop = &loop;
+            q->high = high;
+            q->low = low;
+            q->on_high = std::move(on_high);
+            q->on_low = std::move(on_low);
+
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("sendqueue::enable(): socket closed");
+            if (sendqueue_table.count(desc.id)) throw std::runtime_error("sendqueue::enable(): Send queue already enabled");
+
+            sendqueue_table.emplace(desc.id, q);
+        }
+
+        // Runs on the event loop when `desc` becomes writable.
+        void drain(descriptor desc) {
+            sendqueue_conn q;
+
+            {
+                std::unique_lock lock = libsocket::utils::lock_table();
+
+                auto it = sendqueue_table.find(desc.id);
+
+                if (it == sendqueue_table.end()) return;
+
+                q = it->second;
+            }
+
+            std::unique_lock qlock(q->mtx);
+
+            if (!libsocket::utils::sendqueue::flush(desc, *q)) libsocket::utils::sendqueue::clear(*q);
+
+            if (!q->bytes && q->watching) {
+                q->loop->on_writable(desc, nullptr);
+                q->watching = false;
+            }
+
+            bool fire_low = q->above && q->bytes <= q->low;
+
+            if (fire_low) q->above = false;
+
+            qlock.unlock();
+
+            if (fire_low && q->on_low) q->on_low();
+        }
+
+        // Never blocks: whatever the socket does not take right away is queued. Throws when
+        // the process-wide limit would be exceeded or after the socket failed; returns the
+        // number of bytes now queued on `desc`.
+        uint64_t write(descriptor desc, std::vector<int8_t> buffer) {
+            sendqueue_conn q = find(desc, "sendqueue::write");
+
+            std::unique_lock qlock(q->mtx);
+
+            if (!q->error.empty()) throw std::runtime_error("sendqueue::write(): " + q->error);
+            if (buffer.empty()) return q->bytes;
+
+            if (!libsocket::utils::sendqueue::reserve(buffer.size())) throw std::runtime_error("sendqueue::write(): Process-wide send queue limit exceeded");
+
+            bool was_empty = !q->bytes;
+
+            q->bytes += buffer.size();
+            q->chunks.push_back(std::move(buffer));
+
+            if (was_empty && !libsocket::utils::sendqueue::flush(desc, *q)) {
+                libsocket::utils::sendqueue::clear(*q);
+
+                throw std::runtime_error("sendqueue::write(): " + q->error);
+            }
+
+            if (q->bytes && !q->watching) {
+                q->loop->on_writable(desc, [desc] { libsocket::sendqueue::drain(desc); });
+                q->watching = true;
+            }
+
+            bool fire_high = !q->above && q->bytes > q->high;
+
+            if (fire_high) q->above = true;
+
+            uint64_t bytes = q->bytes;
+
+            qlock.unlock();
+
+            if (fire_high && q->on_high) q->on_high();
+
+            return bytes;
+        }
+
+        uint64_t writestring(descriptor desc, std::string string) {
+            return libsocket::sendqueue::write(desc, std::vector<int8_t>(string.begin(), string.end()));
+        }
+
+        uint64_t queued(descriptor desc) {
+            sendqueue_conn q = find(desc, "sendqueue::queued");
+
+            std::unique_lock qlock(q->mtx);
+
+            return q->bytes;
+        }
+
+        uint64_t queued() {
+            return libsocket::utils::sendqueue::queued.load(std::memory_order_relaxed);
+        }
+
+        void limit(uint64_t bytes) {
+            libsocket::utils::sendqueue::limit.store(bytes, std::memory_order_relaxed);
+        }
+
+        // Drops anything still queued; close() does the same for a queue still enabled.
+        void disable(descriptor desc) {
+            sendqueue_conn q = find(desc, "sendqueue::disable");
+
+            {
+                std::unique_lock qlock(q->mtx);
+
+                if (q->watching) q->loop->on_writable(desc, nullptr);
+
+                q->watching = false;
+
+                libsocket::utils::sendqueue::clear(*q);
+            }
+
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            sendqueue_table.erase(desc.id);
+        }
+    }
+}
@@ -0,0 +1,423 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <stdexcept>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "def.hpp"
+#include "socket.hpp"
+#include "utils.hpp"
+#include "unix.hpp"
+#include "stats.hpp"
+
+#undef unix
+
+namespace libsocket {
+    namespace utils::shm {
+        constexpr uint32_t magic = 0x6c73686d; // "lshm"
+        constexpr int32_t spin_iterations = 4096;
+
+        // Spinning only pays off when the peer runs on another core.
+        const int32_t spin_budget = std::thread::hardware_concurrency() > 1 ? spin_iterations : 0;
+        constexpr int32_t liveness_check_ms = 100;
+        constexpr uint64_t min_capacity = 4096;
+
+        // One direction of the channel: a single-producer/single-consumer byte ring.
+        // `head` and `tail` count bytes ever written/read; the `*_sleeping` words double
+        // as futex doorbells and are only rung when the other side announced it sleeps.
+        struct ring {
+            alignas(64) std::atomic<uint64_t> head;
+            alignas(64) std::atomic<uint64_t> tail;
+            alignas(64) std::atomic<uint32_t> reader_sleeping;
+            std::atomic<uint32_t> writer_sleeping;
+            std::atomic<uint32_t> closed;
+        };
+
+        struct offer_message {
+            uint32_t magic;
+            uint32_t reserved;
+            uint64_t capacity;
+        };
+
+        struct channel {
+            void* base = nullptr;
+            size_t length = 0;
+            uint64_t capacity = 0;
+
+            ring* tx = nullptr;
+            ring* rx = nullptr;
+            int8_t* tx_data = nullptr;
+            int8_t* rx_data = nullptr;
+
+            fd_t fd = -1;
+        };
+
+        void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#elif defined(__aarch64__)
+            asm volatile("yield");
+#endif
+        }
+
+        size_t ring_bytes(uint64_t capacity) {
+            return sizeof(ring) + capacity;
+        }
+
+        void ring_doorbell(std::atomic<uint32_t>& sleeping) {
+            if (sleeping.load()) {
+                sleeping.store(0);
+                futex_wake(sleeping);
+            }
+        }
+
+        bool peer_gone(fd_t fd) {
+            pollfd pfd{fd, POLLRDHUP, 0};
+
+            return ::poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+        }
+
+        // Spins first, then sleeps on `sleeping` until `ready` holds; returns false once the
+        // ring is closed or the UNIX socket the channel was negotiated over hangs up.
+        template<typename Ready>
+        bool wait(channel& ch, ring& r, std::atomic<uint32_t>& sleeping, Ready ready) {
+            for (int32_t i = 0; i < spin_budget; i++) {
+                if (ready()) return true;
+                if (r.closed.load(std::memory_order_acquire)) return false;
+
+                cpu_relax();
+            }
+
+            while (true) {
+                sleeping.store(1);
+
+                // Orders the store before ready()'s loads; the writer stores head and then
+                // checks `sleeping`, so one of the two sides always sees the other.
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                if (ready()) {
+                    sleeping.store(0);
+
+                    return true;
+                }
+
+                if (r.closed.load()) return false;
+
+                futex_wait(sleeping, 1, liveness_check_ms);
+
+                if (ready()) return true;
+                if (r.closed.load() || peer_gone(ch.fd)) return false;
+            }
+        }
+
+        channel map(fd_t memfd, uint64_t capacity, bool offering) {
+            channel ch;
+
+            ch.capacity = capacity;
+            ch.length = 2 * ring_bytes(capacity);
+            ch.base = ::mmap(nullptr, ch.length, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+
+            if (ch.base == MAP_FAILED) throw std::runtime_error("shm: Unable to map ring: " + std::string(strerror(errno)));
+
+            int8_t* first = static_cast<int8_t*>(ch.base);
+            int8_t* second = first + ring_bytes(capacity);
+
+            ch.tx = reinterpret_cast<ring*>(offering ? first : second);
+            ch.rx = reinterpret_cast<ring*>(offering ? second : first);
+            ch.tx_data = reinterpret_cast<int8_t*>(ch.tx) + sizeof(ring);
+            ch.rx_data = reinterpret_cast<int8_t*>(ch.rx) + sizeof(ring);
+
+            return ch;
+        }
+
+        // Tells the peer the channel is gone and wakes anyone sleeping on either ring.
+        void hang_up(channel& ch) {
+            ch.tx->closed.store(1);
+            ch.rx->closed.store(1);
+
+            for (ring* r : {ch.tx, ch.rx}) {
+                futex_wake(r->reader_sleeping);
+                futex_wake(r->writer_sleeping);
+            }
+        }
+    }
+
+    using shm_conn = utils::shm::channel;
+
+    std::map<int32_t, shm_conn> shm_conn_table;
+
+    namespace utils::shm {
+        // close() without shm::shutdown(): no call is inside the rings any more.
+        void release(int32_t id) {
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            auto it = shm_conn_table.find(id);
+
+            if (it == shm_conn_table.end()) return;
+
+            channel ch = it->second;
+            shm_conn_table.erase(it);
+
+            lock.unlock();
+
+            hang_up(ch);
+            ::munmap(ch.base, ch.length);
+        }
+
+        const bool release_on_close = (libsocket::utils::close_hooks.push_back(release), true);
+    }
+
+    namespace shm {
+        // Creates a memfd-backed ring pair and passes it to the peer over `desc`, which must
+        // be a connected unix::socket(); the peer calls shm::accept() on its end.
+        void offer(descriptor desc, uint64_t capacity = 1 << 20) {
+            if (capacity < libsocket::utils::shm::min_capacity || (capacity & (capacity - 1))) throw std::runtime_error("shm::offer(): Capacity must be a power of two of at least 4096");
+
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("shm::offer(): socket closed");
+
+            libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+            if (sock.family != AF_UNIX) throw std::runtime_error("shm::offer(): Not a UNIX socket");
+
+            fd_t memfd = ::memfd_create("libsocket-shm", MFD_CLOEXEC);
+
+            if (memfd == -1) throw std::runtime_error("shm::offer(): Unable to create memfd: " + std::string(strerror(errno)));
+
+            if (::ftruncate(memfd, 2 * libsocket::utils::shm::ring_bytes(capacity)) == -1) {
+                ::close(memfd);
+
+                throw std::runtime_error("shm::offer(): Unable to size memfd: " + std::string(strerror(errno)));
+            }
+
+            shm_conn ch;
+
+            try { ch = libsocket::utils::shm::map(memfd, capacity, true); }
+            catch (const std::exception&) {
+                ::close(memfd);
+
+                throw;
+            }
+
+            ch.fd = sock.fd;
+
+            libsocket::utils::shm::offer_message message{libsocket::utils::shm::magic, 0, capacity};
+            std::vector<int8_t> buffer(sizeof(message));
+            std::memcpy(buffer.data(), &message, sizeof(message));
+
+            libsocket::utils::pin pin(sock);
+            lock.unlock();
+
+            {
+                std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.sendMtx);
+
+                try { libsocket::utils::unix::send_fds(sock.fd, {memfd}, buffer); }
+                catch (const std::exception&) {
+                    ::munmap(ch.base, ch.length);
+                    ::close(memfd);
+
+                    throw;
+                }
+            }
+
+            ::close(memfd);
+
+            lock.lock();
+
+            shm_conn_table.insert_or_assign(desc.id, ch);
+        }
+
+        void accept(descriptor desc) {
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("shm::accept(): socket closed");
+
+            libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+            if (sock.family != AF_UNIX) throw std::runtime_error("shm::accept(): Not a UNIX socket");
+
+            libsocket::utils::pin pin(sock);
+            lock.unlock();
+
+            std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.recvMtx);
+
+            libsocket::utils::shm::offer_message message;
+            std::vector<int8_t> buffer(sizeof(message));
+            std::vector<fd_t> fds = libsocket::utils::unix::recv_fds(sock.fd, buffer);
+
+            std::memcpy(&message, buffer.data(), sizeof(message));
+
+            struct stat st{};
+            bool valid = fds.size() == 1 && message.magic == libsocket::utils::shm::magic && message.capacity >= libsocket::utils::shm::min_capacity &&
+                !(message.capacity & (message.capacity - 1)) && ::fstat(fds[0], &st) == 0 &&
+                static_cast<uint64_t>(st.st_size) == 2 * libsocket::utils::shm::ring_bytes(message.capacity);
+
+            if (!valid) {
+                for (fd_t fd : fds) ::close(fd);
+
+                throw std::runtime_error("shm::accept(): Invalid ring offer");
+            }
+
+            shm_conn ch;
+
+            try { ch = libsocket::utils::shm::map(fds[0], message.capacity, false); }
+            catch (const std::exception&) {
+                ::close(fds[0]);
+
+                throw;
+            }
+
+            ::close(fds[0]);
+
+            ch.fd = sock.fd;
+
+            sock_lock.unlock();
+            lock.lock();
+
+            shm_conn_table.insert_or_assign(desc.id, ch);
+        }
+
+        std::vector<int8_t> read(descriptor desc, int64_t size) {
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("shm::read(): socket closed");
+
+            libsocket::utils::socket& sock = socket_table.at(desc.id);
+            shm_conn ch = shm_conn_table.at(desc.id);
+            uint32_t epoch = sock.layer_epoch;
+
+            libsocket::utils::pin pin(sock);
+            lock.unlock();
+
+            std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.recvMtx);
+
+            if (sock.layer_epoch != epoch) throw std::runtime_error("shm::read(): socket closed");
+
+            libsocket::utils::shm::ring& r = *ch.rx;
+            uint64_t tail = r.tail.load(std::memory_order_relaxed);
+
+            bool ready = libsocket::utils::shm::wait(ch, r, r.reader_sleeping, [&] {
+                return r.head.load(std::memory_order_acquire) != tail;
+            });
+
+            uint64_t head = r.head.load(std::memory_order_acquire);
+            uint64_t count = std::min<uint64_t>(head - tail, size);
+
+            std::vector<int8_t> buffer(count);
+
+            if (!ready && !count) {
+                libsocket::utils::count_read(sock, 0);
+
+                return buffer;
+            }
+
+            uint64_t offset = tail & (ch.capacity - 1);
+            uint64_t first = std::min(count, ch.capacity - offset);
+
+            std::memcpy(buffer.data(), ch.rx_data + offset, first);
+            std::memcpy(buffer.data() + first, ch.rx_data, count - first);
+
+            r.tail.store(tail + count);
+            libsocket::utils::shm::ring_doorbell(r.writer_sleeping);
+
+            libsocket::utils::count_read(sock, count);
+
+            return buffer;
+        }
+
+        std::string readstring(descriptor desc, int64_t size) {
+            std::vector<int8_t> buffer = libsocket::shm::read(desc, size);
+
+            return std::string(buffer.begin(), buffer.end());
+        }
+
+        // Blocks until the whole buffer is in the ring; returns fewer bytes only if the peer
+        // went away.
+        int64_t write(descriptor desc, std::vector<int8_t> buffer) {
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("shm::write(): socket closed");
+
+            libsocket::utils::socket& sock = socket_table.at(desc.id);
+            shm_conn ch = shm_conn_table.at(desc.id);
+            uint32_t epoch = sock.layer_epoch;
+
+            libsocket::utils::pin pin(sock);
+            lock.unlock();
+
+            std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.sendMtx);
+
+            if (sock.layer_epoch != epoch) throw std::runtime_error("shm::write(): socket closed");
+
+            libsocket::utils::shm::ring& r = *ch.tx;
+            uint64_t written = 0;
+
+            while (written < buffer.size()) {
+                uint64_t head = r.head.load(std::memory_order_relaxed);
+
+                bool ready = libsocket::utils::shm::wait(ch, r, r.writer_sleeping, [&] {
+                    return head - r.tail.load(std::memory_order_acquire) < ch.capacity;
+                });
+
+                if (!ready || r.closed.load(std::memory_order_relaxed)) break;
+
+                uint64_t space = ch.capacity - (head - r.tail.load(std::memory_order_acquire));
+                uint64_t count = std::min<uint64_t>(space, buffer.size() - written);
+                uint64_t offset = head & (ch.capacity - 1);
+                uint64_t first = std::min(count, ch.capacity - offset);
+
+                std::memcpy(ch.tx_data + offset, buffer.data() + written, first);
+                std::memcpy(ch.tx_data, buffer.data() + written + first, count - first);
+
+                r.head.store(head + count);
+                libsocket::utils::shm::ring_doorbell(r.reader_sleeping);
+
+                written += count;
+            }
+
+            libsocket::utils::count_write(sock, written, buffer.size());
+
+            return written;
+        }
+
+        int64_t writestring(descriptor desc, std::string string) {
+            return libsocket::shm::write(desc, std::vector<int8_t>(string.begin(), string.end()));
+        }
+
+        void shutdown(descriptor desc) {
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("shm::shutdown(): socket closed");
+
+            libsocket::utils::socket& sock = socket_table.at(desc.id);
+            shm_conn ch = shm_conn_table.at(desc.id);
+
+            shm_conn_table.erase(desc.id);
+            sock.layer_epoch++;
+
+            libsocket::utils::shm::hang_up(ch);
+
+            libsocket::utils::pin pin(sock);
+            lock.unlock();
+
+            // The rings stay mapped until calls already inside them have returned.
+            std::unique_lock recv_lock = libsocket::utils::lock_socket(desc, sock, sock.recvMtx);
+            std::unique_lock send_lock = libsocket::utils::lock_socket(desc, sock, sock.sendMtx);
+
+            ::munmap(ch.base, ch.length);
+        }
+    }
+}
@@ -6,6 +6,7 @@
 
 #include "def.hpp"
 #include "address.hpp"
+#include "stats.hpp"
 
 namespace libsocket {
     namespace utils {
@@ -18,6 +19,15 @@ namespace libsocket {
             std::atomic_bool blocking;
             std::atomic_bool listen;
             std::atomic_bool accepted;
+            std::atomic_bool gro;
+            std::atomic_bool closing;
+
+            // Pinned calls in flight, and a counter bumped whenever an ssl:: or shm:: layer is
+            // torn down so that calls already waiting on the socket mutexes notice.
+            std::atomic<uint32_t> users;
+            std::atomic<uint32_t> layer_epoch;
+
+            std::atomic<int64_t> spin_ns;
 
             int32_t family;
             int32_t type;
@@ -28,6 +38,14 @@ namespace libsocket {
 
             std::recursive_mutex recvMtx;
             std::recursive_mutex sendMtx;
+
+            // Serialises SSL_* calls on the connection, which OpenSSL requires even when the
+            // reader and writer are different threads; always taken after recvMtx/sendMtx.
+            std::mutex sslMtx;
+
+#ifndef LIBSOCKET_NO_STATS
+            libsocket::stats::counters stats;
+#endif
         };
     }
 
@@ -5,15 +5,24 @@
 #include <stdexcept>
 #include <mutex>
 #include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <cerrno>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/bio.h>
 
 #include "def.hpp"
 #include "socket.hpp"
 #include "address.hpp"
 #include "utils.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 
 namespace libsocket {
     using ssl_ctx = SSL_CTX*;
@@ -60,79 +69,291 @@ namespace libsocket {
         void free_context(ssl_ctx ctx) {
             SSL_CTX_free(ctx);
         }
+
+        // Socket BIO that never blocks, so no SSL_* call can sleep while holding sslMtx and
+        // stall the other direction. Blocking descriptors wait in io() with the lock released.
+        int32_t bio_read(BIO* bio, char* data, int32_t size) {
+            int64_t received = ::recv(static_cast<fd_t>(reinterpret_cast<intptr_t>(BIO_get_data(bio))), data, size, MSG_DONTWAIT);
+
+            BIO_clear_retry_flags(bio);
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) BIO_set_retry_read(bio);
+
+            return received;
+        }
+
+        int32_t bio_write(BIO* bio, const char* data, int32_t size) {
+            int64_t sent = ::send(static_cast<fd_t>(reinterpret_cast<intptr_t>(BIO_get_data(bio))), data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+            BIO_clear_retry_flags(bio);
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) BIO_set_retry_write(bio);
+
+            return sent;
+        }
+
+        long bio_ctrl(BIO* bio, int32_t cmd, long, void* ptr) {
+            fd_t fd = static_cast<fd_t>(reinterpret_cast<intptr_t>(BIO_get_data(bio)));
+
+            switch (cmd) {
+                case BIO_CTRL_FLUSH: return 1;
+                case BIO_C_GET_FD:
+                    if (ptr) *static_cast<int*>(ptr) = fd;
+
+                    return fd;
+            }
+
+            return 0;
+        }
+
+        BIO_METHOD* bio_method() {
+            static BIO_METHOD* method = [] {
+                BIO_METHOD* m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK | BIO_TYPE_DESCRIPTOR, "libsocket");
+
+                BIO_meth_set_read(m, bio_read);
+                BIO_meth_set_write(m, bio_write);
+                BIO_meth_set_ctrl(m, bio_ctrl);
+                BIO_meth_set_create(m, [](BIO* bio) { BIO_set_init(bio, 1); return 1; });
+
+                return m;
+            }();
+
+            return method;
+        }
+
+        // Poll timeout matching the socket's SO_RCVTIMEO/SO_SNDTIMEO, -1 when unset.
+        int32_t timeout_ms(fd_t fd, int32_t option) {
+            timeval tv{};
+            socklen_t size = sizeof(tv);
+
+            if (::getsockopt(fd, SOL_SOCKET, option, &tv, &size) == -1 || (!tv.tv_sec && !tv.tv_usec)) return -1;
+
+            return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+        }
+
+        // Runs `call` under the socket's sslMtx. With `wait`, WANT_READ/WANT_WRITE are waited
+        // out in poll() with the lock released; `error` is SSL_get_error()'s result.
+        template <typename Call>
+        int64_t io(libsocket::utils::socket& sock, ssl_conn ssl, int32_t& error, bool wait, Call call) {
+            while (true) {
+                std::unique_lock ssl_lock(sock.sslMtx);
+
+                int64_t status = call();
+                error = status > 0 ? SSL_ERROR_NONE : SSL_get_error(ssl, status);
+
+                ssl_lock.unlock();
+
+                int16_t events = error == SSL_ERROR_WANT_READ ? POLLIN : error == SSL_ERROR_WANT_WRITE ? POLLOUT : 0;
+
+                if (!events || !wait || sock.closing) return status;
+
+                pollfd pfd{sock.fd, events, 0};
+                int32_t ready = ::poll(&pfd, 1, timeout_ms(sock.fd, events == POLLIN ? SO_RCVTIMEO : SO_SNDTIMEO));
+
+                if (!ready || (ready == -1 && errno != EINTR)) return status;
+            }
+        }
     }
 
     namespace ssl {
         void enable(descriptor desc, ssl_ctx ctx) {
-            std::unique_lock lock(socket_table_mutex);
+            std::unique_lock lock = libsocket::utils::lock_table();
 
             if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("ssl::enable(): socket closed");
 
             libsocket::utils::socket& sock = socket_table.at(desc.id);
 
             ssl_conn ssl = SSL_new(ctx);
-            SSL_set_fd(ssl, sock.fd);
+            BIO* bio = BIO_new(libsocket::utils::ssl::bio_method());
+
+            BIO_set_data(bio, reinterpret_cast<void*>(static_cast<intptr_t>(sock.fd)));
+            SSL_set_bio(ssl, bio, bio);
 
             ssl_conn_table.try_emplace(desc.id, ssl);
         }
 
         void handshake(descriptor desc) {
-            std::unique_lock lock(socket_table_mutex);
+            libsocket::trace::scope span(libsocket::trace::event::handshake, desc.id);
+
+            std::unique_lock lock = libsocket::utils::lock_table();
 
             if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("ssl::handshake(): socket closed");
 
             libsocket::utils::socket& sock = socket_table.at(desc.id);
             ssl_conn ssl = ssl_conn_table.at(desc.id);
+            uint32_t epoch = sock.layer_epoch;
 
-            if (sock.accepted) SSL_accept(ssl);
-            else SSL_connect(ssl);
+            libsocket::utils::pin pin(sock);
+            lock.unlock();
+
+            std::unique_lock recv_lock = libsocket::utils::lock_socket(desc, sock, sock.recvMtx);
+            std::unique_lock send_lock = libsocket::utils::lock_socket(desc, sock, sock.sendMtx);
+
+            if (sock.layer_epoch != epoch) throw std::runtime_error("ssl::handshake(): socket closed");
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+            int32_t error;
+            int64_t status = libsocket::utils::ssl::io(sock, ssl, error, sock.blocking, [&] { return sock.accepted ? SSL_accept(ssl) : SSL_connect(ssl); });
+
+            if (status == 1) {
+                libsocket::utils::count(sock, &libsocket::stats::counters::handshakes, 1);
+                libsocket::utils::count(sock, &libsocket::stats::counters::handshake_ns, libsocket::stats::elapsed_ns(start));
+            }
+
+            else libsocket::utils::count(sock, &libsocket::stats::counters::errors, 1);
         }
 
-        std::vector<int8_t> read(descriptor desc, int64_t size) {
-            std::unique_lock lock(socket_table_mutex);
+        // Like libsocket::read(); of the flags only MSG_DONTWAIT is honoured.
+        std::vector<int8_t> read(descriptor desc, int64_t size, int32_t flags = 0) {
+            libsocket::trace::scope span(libsocket::trace::event::read, desc.id);
+
+            std::unique_lock lock = libsocket::utils::lock_table();
 
             if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("ssl::read(): socket closed");
 
+            libsocket::utils::socket& sock = socket_table.at(desc.id);
             ssl_conn ssl = ssl_conn_table.at(desc.id);
+            uint32_t epoch = sock.layer_epoch;
+
+            libsocket::utils::pin pin(sock);
+            lock.unlock();
+
+            std::unique_lock recv_lock = libsocket::utils::lock_socket(desc, sock, sock.recvMtx);
+
+            if (sock.layer_epoch != epoch) throw std::runtime_error("ssl::read(): socket closed");
 
             std::vector<int8_t> buffer(size);
-            buffer.resize(::SSL_read(ssl, buffer.data(), size));
+            int32_t error;
+            int64_t received = libsocket::utils::ssl::io(sock, ssl, error, sock.blocking && !(flags & MSG_DONTWAIT), [&] { return ::SSL_read(ssl, buffer.data(), size); });
+
+            if (received <= 0) {
+                libsocket::utils::count_owned(sock, &libsocket::stats::counters::read_calls, 1);
+
+                if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) libsocket::utils::count(sock, &libsocket::stats::counters::eagain, 1);
+                else if (error != SSL_ERROR_ZERO_RETURN) {
+                    libsocket::utils::count(sock, &libsocket::stats::counters::errors, 1);
+
+                    throw std::runtime_error("ssl::read(): Unable to read from socket: " + std::string(ERR_error_string(ERR_get_error(), nullptr)));
+                }
+
+                received = 0;
+            }
+
+            else libsocket::utils::count_read(sock, received);
+
+            buffer.resize(received);
 
             return buffer;
         }
 
-        std::string readstring(descriptor desc, int64_t size) {
-            std::vector<int8_t> buffer = libsocket::ssl::read(desc, size);
+        std::string readstring(descriptor desc, int64_t size, int32_t flags = 0) {
+            std::vector<int8_t> buffer = libsocket::ssl::read(desc, size, flags);
 
             return std::string(buffer.begin(), buffer.end());
         }
 
-        int64_t write(descriptor desc, std::vector<int8_t> buffer) {
-            std::unique_lock lock(socket_table_mutex);
+        int64_t write(descriptor desc, const int8_t* data, size_t size) {
+            libsocket::trace::scope span(libsocket::trace::event::write, desc.id);
+
+            std::unique_lock lock = libsocket::utils::lock_table();
 
             if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("ssl::write(): socket closed");
 
+            libsocket::utils::socket& sock = socket_table.at(desc.id);
             ssl_conn ssl = ssl_conn_table.at(desc.id);
+            uint32_t epoch = sock.layer_epoch;
+
+            libsocket::utils::pin pin(sock);
+            lock.unlock();
+
+            std::unique_lock send_lock = libsocket::utils::lock_socket(desc, sock, sock.sendMtx);
 
-            return ::SSL_write(ssl, buffer.data(), buffer.size());
+            if (sock.layer_epoch != epoch) throw std::runtime_error("ssl::write(): socket closed");
+
+            int32_t error;
+            int64_t sent = libsocket::utils::ssl::io(sock, ssl, error, sock.blocking, [&] { return ::SSL_write(ssl, data, size); });
+
+            libsocket::utils::count_owned(sock, &libsocket::stats::counters::write_calls, 1);
+
+            if (sent > 0) libsocket::utils::count_owned(sock, &libsocket::stats::counters::write_bytes, sent);
+            else {
+                if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) libsocket::utils::count(sock, &libsocket::stats::counters::eagain, 1);
+                else libsocket::utils::count(sock, &libsocket::stats::counters::errors, 1);
+            }
+
+            return sent;
+        }
+
+        int64_t write(descriptor desc, std::vector<int8_t> buffer) {
+            return libsocket::ssl::write(desc, buffer.data(), buffer.size());
         }
 
         int64_t writestring(descriptor desc, std::string string) {
             return libsocket::ssl::write(desc, std::vector<int8_t>(string.begin(), string.end()));
         }
 
+        // Decrypted bytes already buffered inside OpenSSL, invisible to poll().
+        bool pending(descriptor desc) {
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("ssl::pending(): socket closed");
+
+            libsocket::utils::socket& sock = socket_table.at(desc.id);
+            ssl_conn ssl = ssl_conn_table.at(desc.id);
+            uint32_t epoch = sock.layer_epoch;
+
+            libsocket::utils::pin pin(sock);
+            lock.unlock();
+
+            std::unique_lock ssl_lock(sock.sslMtx);
+
+            if (sock.layer_epoch != epoch) throw std::runtime_error("ssl::pending(): socket closed");
+
+            return SSL_has_pending(ssl);
+        }
+
+        // The peer's close_notify has arrived (SSL_ERROR_ZERO_RETURN): read() returns empty from
+        // now on, even if the TCP connection itself stays open.
+        bool peer_closed(descriptor desc) {
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("ssl::peer_closed(): socket closed");
+
+            libsocket::utils::socket& sock = socket_table.at(desc.id);
+            ssl_conn ssl = ssl_conn_table.at(desc.id);
+            uint32_t epoch = sock.layer_epoch;
+
+            libsocket::utils::pin pin(sock);
+            lock.unlock();
+
+            std::unique_lock ssl_lock(sock.sslMtx);
+
+            if (sock.layer_epoch != epoch) throw std::runtime_error("ssl::peer_closed(): socket closed");
+
+            return SSL_get_shutdown(ssl) & SSL_RECEIVED_SHUTDOWN;
+        }
+
+        // Detaches the SSL object under the table lock, so calls queued on the socket mutexes
+        // see the bumped layer epoch and give up, then frees it once in-flight calls are done.
         void shutdown(descriptor desc) {
-            std::unique_lock lock(socket_table_mutex);
+            std::unique_lock lock = libsocket::utils::lock_table();
 
             if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("ssl::shutdown(): socket closed");
 
             libsocket::utils::socket& sock = socket_table.at(desc.id);
             ssl_conn ssl = ssl_conn_table.at(desc.id);
 
+            ssl_conn_table.erase(desc.id);
+            sock.layer_epoch++;
+
+            libsocket::utils::pin pin(sock);
+            lock.unlock();
+
+            std::unique_lock recv_lock = libsocket::utils::lock_socket(desc, sock, sock.recvMtx);
+            std::unique_lock send_lock = libsocket::utils::lock_socket(desc, sock, sock.sendMtx);
+            std::unique_lock ssl_lock(sock.sslMtx);
+
             if (!ERR_get_error() || !SSL_get_shutdown(ssl)) SSL_shutdown(ssl);
             SSL_free(ssl);
-
-            ssl_conn_table.erase(desc.id);
         }
     }
 }
@@ -0,0 +1,148 @@
+#pragma once
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace libsocket::stats {
+    struct counters {
+        std::atomic<uint64_t> read_calls{0};
+        std::atomic<uint64_t> read_bytes{0};
+        std::atomic<uint64_t> write_calls{0};
+        std::atomic<uint64_t> write_bytes{0};
+        std::atomic<uint64_t> short_writes{0};
+        std::atomic<uint64_t> eagain{0};
+        std::atomic<uint64_t> errors{0};
+        std::atomic<uint64_t> accepts{0};
+        std::atomic<uint64_t> handshakes{0};
+        std::atomic<uint64_t> handshake_ns{0};
+        std::atomic<uint64_t> table_waits{0};
+        std::atomic<uint64_t> table_wait_ns{0};
+        std::atomic<uint64_t> socket_waits{0};
+        std::atomic<uint64_t> socket_wait_ns{0};
+        std::atomic<uint64_t> spin_hits{0};
+        std::atomic<uint64_t> spin_misses{0};
+    };
+
+    struct snapshot_t {
+        uint64_t read_calls;
+        uint64_t read_bytes;
+        uint64_t write_calls;
+        uint64_t write_bytes;
+        uint64_t short_writes;
+        uint64_t eagain;
+        uint64_t errors;
+        uint64_t accepts;
+        uint64_t handshakes;
+        uint64_t handshake_ns;
+        uint64_t table_waits;
+        uint64_t table_wait_ns;
+        uint64_t socket_waits;
+        uint64_t socket_wait_ns;
+        uint64_t spin_hits;
+        uint64_t spin_misses;
+    };
+
+    using field = std::atomic<uint64_t> counters::*;
+
+    // Global counters are sharded per thread: only the owning thread writes its shard,
+    // so an update is a relaxed load/store pair instead of a locked read-modify-write.
+    // Shards are never freed, which keeps them readable after their thread exits.
+    std::list<counters> thread_counters;
+    std::mutex thread_counters_mutex;
+
+    counters& local() {
+        thread_local counters* shard = nullptr;
+
+        if (!shard) {
+            std::unique_lock lock(thread_counters_mutex);
+
+            shard = &thread_counters.emplace_back();
+        }
+
+        return *shard;
+    }
+
+    void add([[maybe_unused]] field f, [[maybe_unused]] uint64_t value) {
+#ifndef LIBSOCKET_NO_STATS
+        std::atomic<uint64_t>& counter = local().*f;
+
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+#endif
+    }
+
+    void add([[maybe_unused]] counters& sock, [[maybe_unused]] field f, [[maybe_unused]] uint64_t value) {
+#ifndef LIBSOCKET_NO_STATS
+        (sock.*f).fetch_add(value, std::memory_order_relaxed);
+
+        add(f, value);
+#endif
+    }
+
+    // For a per-socket counter only ever updated under one of the socket's mutexes, so the
+    // same load/store pair as the thread shards suffices.
+    void add_owned([[maybe_unused]] counters& sock, [[maybe_unused]] field f, [[maybe_unused]] uint64_t value) {
+#ifndef LIBSOCKET_NO_STATS
+        std::atomic<uint64_t>& counter = sock.*f;
+
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+
+        add(f, value);
+#endif
+    }
+
+    uint64_t elapsed_ns(std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+    }
+
+    snapshot_t snapshot(const counters& c) {
+        return {
+            c.read_calls.load(std::memory_order_relaxed),
+            c.read_bytes.load(std::memory_order_relaxed),
+            c.write_calls.load(std::memory_order_relaxed),
+            c.write_bytes.load(std::memory_order_relaxed),
+            c.short_writes.load(std::memory_order_relaxed),
+            c.eagain.load(std::memory_order_relaxed),
+            c.errors.load(std::memory_order_relaxed),
+            c.accepts.load(std::memory_order_relaxed),
+            c.handshakes.load(std::memory_order_relaxed),
+            c.handshake_ns.load(std::memory_order_relaxed),
+            c.table_waits.load(std::memory_order_relaxed),
+            c.table_wait_ns.load(std::memory_order_relaxed),
+            c.socket_waits.load(std::memory_order_relaxed),
+            c.socket_wait_ns.load(std::memory_order_relaxed),
+            c.spin_hits.load(std::memory_order_relaxed),
+            c.spin_misses.load(std::memory_order_relaxed)
+        };
+    }
+
+    snapshot_t snapshot() {
+        std::unique_lock lock(thread_counters_mutex);
+
+        snapshot_t total{};
+
+        for (const counters& shard : thread_counters) {
+            snapshot_t s = snapshot(shard);
+
+            total.read_calls += s.read_calls;
+            total.read_bytes += s.read_bytes;
+            total.write_calls += s.write_calls;
+            total.write_bytes += s.write_bytes;
+            total.short_writes += s.short_writes;
+            total.eagain += s.eagain;
+            total.errors += s.errors;
+            total.accepts += s.accepts;
+            total.handshakes += s.handshakes;
+            total.handshake_ns += s.handshake_ns;
+            total.table_waits += s.table_waits;
+            total.table_wait_ns += s.table_wait_ns;
+            total.socket_waits += s.socket_waits;
+            total.socket_wait_ns += s.socket_wait_ns;
+            total.spin_hits += s.spin_hits;
+            total.spin_misses += s.spin_misses;
+        }
+
+        return total;
+    }
+}
@@ -0,0 +1,228 @@
+#pragma once
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <mutex>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "def.hpp"
+#include "socket.hpp"
+#include "utils.hpp"
+#include "event.hpp"
+
+namespace libsocket {
+    struct tcp_metrics {
+        uint8_t state;
+        uint8_t ca_state;
+
+        uint32_t rtt_us;
+        uint32_t rttvar_us;
+        uint32_t min_rtt_us;
+        uint32_t rto_us;
+
+        uint32_t cwnd;
+        uint32_t ssthresh;
+        uint32_t mss;
+
+        uint32_t unacked;
+        uint32_t lost;
+        uint32_t retransmits;
+        uint32_t total_retransmits;
+
+        uint64_t delivery_rate;
+        uint64_t pacing_rate;
+        bool app_limited;
+
+        uint64_t bytes_acked;
+        uint64_t bytes_received;
+        uint32_t notsent_bytes;
+
+        uint32_t rcv_space;
+        uint32_t rcv_rtt_us;
+    };
+
+    // Adaptive buffer sizing: every `interval_ms`, SO_SNDBUF and SO_RCVBUF are set to
+    // `headroom` times the measured bandwidth-delay product, clamped to [min_bytes, max_bytes].
+    struct buffer_policy {
+        int32_t interval_ms = 250;
+        uint64_t min_bytes = 64 << 10;
+        uint64_t max_bytes = 16 << 20;
+        double headroom = 2.0;
+    };
+
+    namespace utils::tcpinfo {
+        // Kernel struct tcp_info up to tcpi_delivery_rate. glibc's <netinet/tcp.h> stops at
+        // tcpi_total_retrans and <linux/tcp.h> cannot be included next to it, so the layout
+        // is mirrored here; fields beyond what the running kernel reports stay zero.
+        struct kernel_tcp_info {
+            uint8_t state;
+            uint8_t ca_state;
+            uint8_t retransmits;
+            uint8_t probes;
+            uint8_t backoff;
+            uint8_t options;
+            uint8_t wscale;
+            uint8_t flags;
+
+            uint32_t rto;
+            uint32_t ato;
+            uint32_t snd_mss;
+            uint32_t rcv_mss;
+
+            uint32_t unacked;
+            uint32_t sacked;
+            uint32_t lost;
+            uint32_t retrans;
+            uint32_t fackets;
+
+            uint32_t last_data_sent;
+            uint32_t last_ack_sent;
+            uint32_t last_data_recv;
+            uint32_t last_ack_recv;
+
+            uint32_t pmtu;
+            uint32_t rcv_ssthresh;
+            uint32_t rtt;
+            uint32_t rttvar;
+            uint32_t snd_ssthresh;
+            uint32_t snd_cwnd;
+            uint32_t advmss;
+            uint32_t reordering;
+
+            uint32_t rcv_rtt;
+            uint32_t rcv_space;
+
+            uint32_t total_retrans;
+
+            uint64_t pacing_rate;
+            uint64_t max_pacing_rate;
+            uint64_t bytes_acked;
+            uint64_t bytes_received;
+            uint32_t segs_out;
+            uint32_t segs_in;
+
+            uint32_t notsent_bytes;
+            uint32_t min_rtt;
+            uint32_t data_segs_in;
+            uint32_t data_segs_out;
+
+            uint64_t delivery_rate;
+        };
+
+        static_assert(sizeof(kernel_tcp_info) == 168, "kernel_tcp_info must match the kernel layout");
+
+        struct adapt_state {
+            std::mutex mtx;             // held while the timer id is stored, so a first tick waits for it
+            uint64_t timer = 0;
+            uint64_t bytes_acked = 0;
+            uint64_t bytes_received = 0;
+            uint64_t sndbuf = 0;
+            uint64_t rcvbuf = 0;
+        };
+
+        uint64_t target(uint64_t bdp, const buffer_policy& policy) {
+            return std::clamp<uint64_t>(bdp * policy.headroom, policy.min_bytes, policy.max_bytes);
+        }
+
+        // Hysteresis: only touch the buffer when the target moved by more than a quarter.
+        void resize(descriptor desc, int32_t optname, uint64_t& current, uint64_t size) {
+            uint64_t delta = size > current ? size - current : current - size;
+
+            if (current && delta <= current / 4) return;
+
+            libsocket::utils::setsockopt<int32_t>(desc, SOL_SOCKET, optname, size);
+
+            current = size;
+        }
+    }
+
+    tcp_metrics tcp_info(descriptor desc) {
+        libsocket::utils::tcpinfo::kernel_tcp_info info{};
+
+        std::unique_lock lock = libsocket::utils::lock_table();
+
+        if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("tcp_info(): socket closed");
+
+        libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+        if (sock.type != SOCK_STREAM || sock.family == AF_UNIX) throw std::runtime_error("tcp_info(): Not a TCP socket");
+
+        socklen_t size = sizeof(info);
+
+        if (::getsockopt(sock.fd, IPPROTO_TCP, TCP_INFO, &info, &size) == -1) throw std::runtime_error("tcp_info(): Unable to get TCP_INFO: " + std::string(strerror(errno)));
+
+        return {
+            info.state,
+            info.ca_state,
+            info.rtt,
+            info.rttvar,
+            info.min_rtt,
+            info.rto,
+            info.snd_cwnd,
+            info.snd_ssthresh,
+            info.snd_mss,
+            info.unacked,
+            info.lost,
+            info.retrans,
+            info.total_retrans,
+            info.delivery_rate,
+            info.pacing_rate,
+            static_cast<bool>(info.flags & 1),
+            info.bytes_acked,
+            info.bytes_received,
+            info.notsent_bytes,
+            info.rcv_space,
+            info.rcv_rtt
+        };
+    }
+
+    // Periodically resizes the socket buffers of `desc` on `loop` from tcp_info(): the send
+    // side from delivery rate times RTT, the receive side from the kernel's per-RTT receive
+    // estimate. Idle connections shrink to `min_bytes`. Setting either buffer turns off the
+    // kernel's own autotuning for it. The timer stops itself once `desc` is closed; the
+    // returned id can also be passed to loop.cancel().
+    uint64_t adapt_buffers(event_loop& loop, descriptor desc, buffer_policy policy = {}) {
+        tcp_info(desc);
+
+        auto state = std::make_shared<libsocket::utils::tcpinfo::adapt_state>();
+        std::unique_lock lock(state->mtx);
+
+        state->timer = loop.every(policy.interval_ms, [&loop, desc, policy, state] {
+            std::unique_lock lock(state->mtx);
+            tcp_metrics m;
+
+            try { m = tcp_info(desc); }
+            catch (const std::runtime_error&) {
+                loop.cancel(state->timer);
+
+                return;
+            }
+
+            bool idle = m.bytes_acked == state->bytes_acked && m.bytes_received == state->bytes_received && !m.unacked && !m.notsent_bytes;
+
+            state->bytes_acked = m.bytes_acked;
+            state->bytes_received = m.bytes_received;
+
+            uint64_t rate = m.delivery_rate ? m.delivery_rate : static_cast<uint64_t>(m.cwnd) * m.mss * 1000000 / std::max<uint32_t>(m.rtt_us, 1);
+            uint64_t send_bdp = idle ? 0 : rate * m.rtt_us / 1000000;
+            uint64_t recv_bdp = idle ? 0 : m.rcv_space;
+
+            try {
+                libsocket::utils::tcpinfo::resize(desc, SO_SNDBUF, state->sndbuf, libsocket::utils::tcpinfo::target(send_bdp, policy));
+                libsocket::utils::tcpinfo::resize(desc, SO_RCVBUF, state->rcvbuf, libsocket::utils::tcpinfo::target(recv_bdp, policy));
+            }
+
+            catch (const std::runtime_error&) {
+                loop.cancel(state->timer);
+            }
+        });
+
+        return state->timer;
+    }
+}
@@ -0,0 +1,98 @@
+#include <thread>
+#include <chrono>
+#include <cstdint>
+
+#include <sched.h>
+
+#include "test.hpp"
+
+namespace {
+    libsocket::utils::socket& entry(libsocket::descriptor desc) {
+        return libsocket::socket_table.at(desc.id);
+    }
+
+    // With one usable CPU spinning only steals time from the writer: busy_poll() refuses,
+    // and reads block as before.
+    void single_cpu() {
+        cpu_set_t saved;
+        cpu_set_t one;
+
+        CHECK(::sched_getaffinity(0, sizeof(saved), &saved) == 0);
+
+        CPU_ZERO(&one);
+
+        for (int32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &saved)) continue;
+
+            CPU_SET(cpu, &one);
+
+            break;
+        }
+
+        CHECK(::sched_setaffinity(0, sizeof(one), &one) == 0);
+
+        auto [client, server] = test::tcp_pair();
+
+        CHECK(!libsocket::busy_poll(server, 50));
+        CHECK(entry(server).spin_ns == 0);
+
+        std::thread writer([client = client] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+            libsocket::writestring(client, "late");
+        });
+
+        CHECK(libsocket::read(server, 4).size() == 4);
+
+        writer.join();
+
+        CHECK(libsocket::stats::snapshot(server).spin_hits == 0);
+        CHECK(libsocket::stats::snapshot(server).spin_misses == 0);
+
+        CHECK(::sched_setaffinity(0, sizeof(saved), &saved) == 0);
+
+        libsocket::close(client);
+        libsocket::close(server);
+    }
+
+    // The spin loop itself, forced on regardless of the CPU count: data already queued is a
+    // hit, data arriving after the budget is a miss that falls back to a blocking read, and
+    // MSG_DONTWAIT never spins.
+    void spin_fallback() {
+        auto [client, server] = test::tcp_pair();
+
+        entry(server).spin_ns = 2000000;
+
+        libsocket::writestring(client, "now");
+
+        CHECK(libsocket::read(server, 3).size() == 3);
+        CHECK(libsocket::stats::snapshot(server).spin_hits == 1);
+
+        std::thread writer([client = client] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(30));
+
+            libsocket::writestring(client, "late");
+        });
+
+        CHECK(libsocket::read(server, 4).size() == 4);
+
+        writer.join();
+
+        CHECK(libsocket::stats::snapshot(server).spin_misses == 1);
+
+        CHECK(libsocket::read(server, 4, MSG_DONTWAIT).empty());
+        CHECK(libsocket::stats::snapshot(server).spin_misses == 1);
+
+        libsocket::busy_poll(server, 0);
+
+        CHECK(entry(server).spin_ns == 0);
+
+        libsocket::close(client);
+        libsocket::close(server);
+    }
+}
+
+int main() {
+    test::run("single_cpu", single_cpu);
+    test::run("spin_fallback", spin_fallback);
+}
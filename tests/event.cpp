@@ -0,0 +1,65 @@
+#include <thread>
+#include <chrono>
+#include <cstdint>
+
+#include "event.hpp"
+#include "test.hpp"
+
+namespace {
+    // A timer that overruns its interval fires once per turn, and I/O keeps being served.
+    void overrunning_timer() {
+        auto [client, server] = test::tcp_pair();
+
+        libsocket::event_loop loop;
+        int32_t fired = 0;
+        int32_t reads = 0;
+
+        loop.every(1, [&] {
+            fired++;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(3));
+        });
+
+        loop.on_readable(server, [&] {
+            reads++;
+
+            CHECK(libsocket::read(server, 64).size() == 1);
+        });
+
+        for (int32_t turn = 1; turn <= 5; turn++) {
+            libsocket::writestring(client, "x");
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+
+            loop.run_once(0);
+
+            CHECK(fired == turn);
+            CHECK(reads == turn);
+        }
+
+        loop.remove(server);
+        libsocket::close(client);
+        libsocket::close(server);
+    }
+
+    // A timer cancelled by a callback that ran first in the same turn does not fire.
+    void cancel_in_turn() {
+        libsocket::event_loop loop;
+        uint64_t second = 0;
+        int32_t fired = 0;
+
+        loop.every(1, [&] { loop.cancel(second); });
+        second = loop.every(1, [&] { fired++; });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+
+        loop.run_once(0);
+
+        CHECK(fired == 0);
+    }
+}
+
+int main() {
+    test::run("overrunning_timer", overrunning_timer);
+    test::run("cancel_in_turn", cancel_in_turn);
+}
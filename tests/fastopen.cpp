@@ -0,0 +1,148 @@
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+
+#include <sched.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "udp.hpp"
+#include "test.hpp"
+
+namespace {
+    std::string text(const std::vector<int8_t>& data) {
+        return std::string(data.begin(), data.end());
+    }
+
+    // connect() with a payload delivers it whichever path the kernel takes (SYN data with a
+    // cookie, after the handshake without one, or the connect()+write() fallback), and a
+    // deferred accept(listener, size) hands it over with the connection.
+    void payload() {
+        libsocket::descriptor listener = libsocket::ipv4::tcp::socket();
+
+        libsocket::bind(listener, libsocket::address(127, 0, 0, 1, 0));
+        libsocket::listen(listener, 4, 16);
+        libsocket::defer_accept(listener, 5);
+
+        libsocket::address addr = libsocket::utils::getsockname(listener);
+
+        // The first connection fetches a cookie where TFO is on; the second may use it.
+        for (int32_t i = 0; i < 2; i++) {
+            libsocket::descriptor client = libsocket::ipv4::tcp::socket();
+
+            CHECK(libsocket::connectstring(client, addr, "hello") == 5);
+
+            libsocket::accepted_connection conn = libsocket::accept(listener, 64);
+
+            CHECK(text(conn.data) == "hello");
+
+            libsocket::writestring(conn.desc, "world");
+
+            CHECK(libsocket::readstring(client, 5) == "world");
+
+            libsocket::close(conn.desc);
+            libsocket::close(client);
+        }
+
+        libsocket::close(listener);
+    }
+
+    // The connect()+write() fallback, taken when net.ipv4.tcp_fastopen is 0. That sysctl is
+    // per network namespace, so the check runs in a child with a namespace of its own, and
+    // is skipped where one cannot be created.
+    void fallback() {
+        pid_t child = ::fork();
+
+        if (child == 0) {
+            if (::unshare(CLONE_NEWNET) == -1) ::_exit(77);
+
+            ifreq ifr{};
+            std::strncpy(ifr.ifr_name, "lo", IFNAMSIZ - 1);
+
+            int32_t fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+
+            if (::ioctl(fd, SIOCGIFFLAGS, &ifr) == -1) ::_exit(77);
+
+            ifr.ifr_flags |= IFF_UP;
+
+            if (::ioctl(fd, SIOCSIFFLAGS, &ifr) == -1) ::_exit(77);
+
+            ::close(fd);
+
+            std::ofstream("/proc/sys/net/ipv4/tcp_fastopen") << 0;
+
+            payload();
+
+            ::_exit(0);
+        }
+
+        int32_t status = 0;
+
+        ::waitpid(child, &status, 0);
+
+        CHECK(WIFEXITED(status));
+
+        if (WEXITSTATUS(status) == 77) std::cout << "fallback: skipped, no network namespace" << std::endl;
+        else CHECK(WEXITSTATUS(status) == 0);
+    }
+
+    // Without deferred accept a connection that has not sent anything comes back empty.
+    void empty_accept() {
+        libsocket::descriptor listener = libsocket::ipv4::tcp::socket();
+
+        libsocket::bind(listener, libsocket::address(127, 0, 0, 1, 0));
+        libsocket::listen(listener, 4);
+
+        libsocket::descriptor client = libsocket::ipv4::tcp::socket();
+
+        libsocket::connect(client, libsocket::utils::getsockname(listener));
+
+        libsocket::accepted_connection conn = libsocket::accept(listener, 64);
+
+        CHECK(conn.data.empty());
+
+        libsocket::close(conn.desc);
+        libsocket::close(client);
+        libsocket::close(listener);
+    }
+
+    // A refused connection names the step that failed; UDP sockets are turned away.
+    void errors() {
+        libsocket::descriptor listener = libsocket::ipv4::tcp::socket();
+
+        libsocket::bind(listener, libsocket::address(127, 0, 0, 1, 0));
+
+        libsocket::address refused = libsocket::utils::getsockname(listener);
+
+        libsocket::close(listener);
+
+        libsocket::descriptor client = libsocket::ipv4::tcp::socket();
+        std::string message;
+
+        try { libsocket::connectstring(client, refused, "hello"); }
+        catch (const std::runtime_error& e) { message = e.what(); }
+
+        CHECK(message.rfind("connect(): Unable to connect to host: ", 0) == 0);
+
+        libsocket::descriptor udp = libsocket::ipv4::udp::socket();
+
+        CHECK_THROWS(libsocket::connectstring(udp, refused, "hello"));
+        CHECK_THROWS(libsocket::listen(udp, 4, 16));
+        CHECK_THROWS(libsocket::defer_accept(udp, 5));
+
+        libsocket::close(client);
+        libsocket::close(udp);
+    }
+}
+
+int main() {
+    test::run("payload", payload);
+    test::run("fallback", fallback);
+    test::run("empty_accept", empty_accept);
+    test::run("errors", errors);
+}
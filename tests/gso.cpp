@@ -0,0 +1,101 @@
+#include <vector>
+#include <cstdint>
+
+#include <sys/socket.h>
+
+#include "udp.hpp"
+#include "test.hpp"
+
+namespace {
+    std::vector<int8_t> pattern(size_t size) {
+        std::vector<int8_t> buffer(size);
+
+        for (size_t i = 0; i < size; i++) buffer[i] = static_cast<int8_t>(i % 251);
+
+        return buffer;
+    }
+
+    // Bound loopback UDP socket.
+    libsocket::descriptor udp_socket() {
+        libsocket::descriptor sock = libsocket::ipv4::udp::socket();
+
+        libsocket::bind(sock, libsocket::address(127, 0, 0, 1, 0));
+
+        return sock;
+    }
+
+    // Without GRO the receiver sees plain datagrams of segment_size bytes, the last one
+    // shorter, across more than one sendmsg() batch (64 segments each).
+    void segments() {
+        libsocket::descriptor sender = udp_socket();
+        libsocket::descriptor receiver = udp_socket();
+
+        libsocket::utils::setsockopt<int32_t>(receiver, SOL_SOCKET, SO_RCVBUF, 4 << 20);
+
+        std::vector<int8_t> payload = pattern(100 * 1000 + 123);
+
+        CHECK(libsocket::writeto_segmented(sender, payload, 1000, libsocket::utils::getsockname(receiver)) == static_cast<int64_t>(payload.size()));
+
+        std::vector<int8_t> received;
+
+        for (int32_t i = 0; i < 101; i++) {
+            libsocket::datagram d = libsocket::readfrom(receiver, 2000);
+
+            CHECK(d.segment_size == 0);
+            CHECK(d.data.size() == (i < 100 ? 1000 : 123));
+
+            received.insert(received.end(), d.data.begin(), d.data.end());
+        }
+
+        CHECK(received == payload);
+        CHECK(libsocket::readfrom(receiver, 2000, MSG_DONTWAIT).data.empty());
+
+        libsocket::close(sender);
+        libsocket::close(receiver);
+    }
+
+    // With GRO a loopback GSO send arrives as the one buffer it left as, and segment_size
+    // says how to split it.
+    void gro() {
+        libsocket::descriptor sender = udp_socket();
+        libsocket::descriptor receiver = udp_socket();
+
+        libsocket::udp_gro(receiver);
+
+        std::vector<int8_t> payload = pattern(10 * 1000);
+
+        libsocket::writeto_segmented(sender, payload, 1000, libsocket::utils::getsockname(receiver));
+
+        libsocket::datagram d = libsocket::readfrom(receiver, 65536);
+
+        CHECK(d.segment_size == 1000);
+        CHECK(d.data == payload);
+
+        libsocket::udp_gro(receiver, false);
+        libsocket::writeto_segmented(sender, payload, 1000, libsocket::utils::getsockname(receiver));
+
+        CHECK(libsocket::readfrom(receiver, 65536).data.size() == 1000);
+
+        libsocket::close(sender);
+        libsocket::close(receiver);
+    }
+
+    void invalid() {
+        libsocket::descriptor sender = udp_socket();
+        libsocket::descriptor tcp = libsocket::ipv4::tcp::socket();
+        libsocket::address to = libsocket::utils::getsockname(sender);
+
+        CHECK_THROWS(libsocket::writeto_segmented(sender, pattern(10), 0, to));
+        CHECK_THROWS(libsocket::writeto_segmented(sender, pattern(10), 70000, to));
+        CHECK_THROWS(libsocket::writeto_segmented(tcp, pattern(10), 5, to));
+
+        libsocket::close(sender);
+        libsocket::close(tcp);
+    }
+}
+
+int main() {
+    test::run("segments", segments);
+    test::run("gro", gro);
+    test::run("invalid", invalid);
+}
@@ -0,0 +1,153 @@
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+
+#include "handshake.hpp"
+#include "test.hpp"
+#include "tls.hpp"
+
+namespace {
+    template <typename Pred>
+    bool eventually(Pred pred) {
+        for (int32_t i = 0; i < 200; i++) {
+            if (pred()) return true;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+
+        return false;
+    }
+
+    libsocket::descriptor listener() {
+        libsocket::descriptor sock = libsocket::ipv4::tcp::socket();
+
+        libsocket::bind(sock, libsocket::address(127, 0, 0, 1, 0));
+        libsocket::listen(sock, 16);
+
+        return sock;
+    }
+
+    // A handshake driven by the pool ends in done(desc, true) with the descriptor back in
+    // its original blocking mode and ready for application data.
+    void completes() {
+        fixture::tls_state tls = fixture::make_tls();
+        libsocket::descriptor server = listener();
+
+        libsocket::handshake_policy policy;
+        policy.threads = 2;
+
+        libsocket::handshake_pool pool(policy);
+        std::atomic<int32_t> ok{0};
+
+        pool.serve(server, tls.server_ctx, [&](libsocket::descriptor desc, bool good) {
+            CHECK(good);
+            CHECK(libsocket::socket_table.at(desc.id).blocking);
+
+            libsocket::ssl::write(desc, std::vector<int8_t>{'h', 'i'});
+            ok++;
+        });
+
+        libsocket::descriptor client = libsocket::ipv4::tcp::socket();
+
+        libsocket::connect(client, libsocket::utils::getsockname(server));
+        libsocket::ssl::enable(client, tls.client_ctx);
+        libsocket::ssl::handshake(client);
+
+        CHECK(libsocket::ssl::read(client, 2).size() == 2);
+        CHECK(eventually([&] { return ok == 1; }));
+
+        libsocket::handshake_stats stats = pool.stats();
+
+        CHECK(stats.completed == 1 && stats.failed == 0 && stats.pending == 0);
+
+        pool.stop();
+        libsocket::close(client);
+        libsocket::close(server);
+    }
+
+    // Beyond max_pending, new connections are closed without any TLS work, and the held
+    // slots count as pending until the handshakes end.
+    void admission() {
+        fixture::tls_state tls = fixture::make_tls();
+        libsocket::descriptor server = listener();
+
+        libsocket::handshake_policy policy;
+        policy.threads = 1;
+        policy.max_pending = 2;
+
+        libsocket::handshake_pool pool(policy);
+        std::atomic<int32_t> failed{0};
+
+        pool.serve(server, tls.server_ctx, [&](libsocket::descriptor desc, bool good) {
+            if (!good) failed++;
+
+            libsocket::ssl::shutdown(desc);
+            libsocket::close(desc);
+        });
+
+        std::vector<libsocket::descriptor> clients;
+
+        for (int32_t i = 0; i < 4; i++) {
+            clients.push_back(libsocket::ipv4::tcp::socket());
+            libsocket::connect(clients.back(), libsocket::utils::getsockname(server));
+        }
+
+        CHECK(eventually([&] { return pool.stats().rejected == 2; }));
+        CHECK(pool.stats().pending == 2);
+
+        // The two rejected clients see EOF; the admitted ones are still waiting.
+        CHECK(libsocket::read(clients[2], 1).empty());
+        CHECK(libsocket::read(clients[3], 1).empty());
+
+        pool.stop();
+
+        CHECK(failed == 2);
+        CHECK(pool.stats().pending == 0);
+
+        for (libsocket::descriptor d : clients) libsocket::close(d);
+
+        libsocket::close(server);
+    }
+
+    // A client that never speaks TLS fails after timeout_ms instead of holding its slot.
+    void timeout() {
+        fixture::tls_state tls = fixture::make_tls();
+        libsocket::descriptor server = listener();
+
+        libsocket::handshake_policy policy;
+        policy.threads = 1;
+        policy.timeout_ms = 50;
+
+        libsocket::handshake_pool pool(policy);
+        std::atomic<int32_t> failed{0};
+
+        pool.serve(server, tls.server_ctx, [&](libsocket::descriptor desc, bool good) {
+            if (!good) failed++;
+
+            libsocket::ssl::shutdown(desc);
+            libsocket::close(desc);
+        });
+
+        libsocket::descriptor client = libsocket::ipv4::tcp::socket();
+
+        libsocket::connect(client, libsocket::utils::getsockname(server));
+
+        CHECK(eventually([&] { return failed == 1; }));
+
+        libsocket::handshake_stats stats = pool.stats();
+
+        CHECK(stats.timed_out == 1 && stats.failed == 1 && stats.pending == 0);
+
+        pool.stop();
+        libsocket::close(client);
+        libsocket::close(server);
+    }
+}
+
+int main() {
+    test::run("completes", completes);
+    test::run("admission", admission);
+    test::run("timeout", timeout);
+}
@@ -0,0 +1,83 @@
+#include <vector>
+#include <cstdint>
+
+#include "histogram.hpp"
+#include "test.hpp"
+
+namespace {
+    void exact_below_linear() {
+        libsocket::histogram h;
+
+        for (uint64_t v = 0; v < 128; v++) h.record(v);
+
+        CHECK(h.count() == 128);
+        CHECK(h.min() == 0);
+        CHECK(h.max() == 127);
+        CHECK(h.mean() == 63);
+        CHECK(h.percentile(50) == 63);
+        CHECK(h.percentile(100) == 127);
+    }
+
+    // Above 2^7 a bucket keeps 7 significant bits, so a value reads back at most 1/64 low.
+    void bucket_error() {
+        for (uint64_t v = 128; v < (uint64_t(1) << 62); v += v / 7 + 1) {
+            libsocket::histogram h;
+
+            h.record(0);
+            h.record(v);
+
+            uint64_t p = h.percentile(100);
+
+            CHECK(p <= v);
+            CHECK(v - p <= v / 64);
+        }
+    }
+
+    void bucket_edges() {
+        for (uint64_t edge : {uint64_t(128), uint64_t(256), uint64_t(1) << 20, uint64_t(1) << 40}) {
+            libsocket::histogram below;
+            libsocket::histogram at;
+
+            below.record(0);
+            below.record(edge - 1);
+            at.record(0);
+            at.record(edge);
+
+            CHECK(at.percentile(100) == edge);
+            CHECK(below.percentile(100) < edge);
+        }
+    }
+
+    void merge() {
+        libsocket::histogram a;
+        libsocket::histogram b;
+
+        for (uint64_t v = 1; v <= 50; v++) a.record(v);
+        for (uint64_t v = 51; v <= 100; v++) b.record(v);
+
+        a.merge(b);
+
+        CHECK(a.count() == 100);
+        CHECK(a.min() == 1);
+        CHECK(a.max() == 100);
+        CHECK(a.percentile(50) == 50);
+        CHECK(a.percentile(99) == 99);
+    }
+
+    void empty() {
+        libsocket::histogram h;
+
+        CHECK(h.count() == 0);
+        CHECK(h.min() == 0);
+        CHECK(h.max() == 0);
+        CHECK(h.percentile(99) == 0);
+    }
+}
+
+int main() {
+    test::run("exact_below_linear", exact_below_linear);
+    test::run("bucket_error", bucket_error);
+    test::run("bucket_edges", bucket_edges);
+    test::run("merge", merge);
+    test::run("empty", empty);
+}
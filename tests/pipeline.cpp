@@ -0,0 +1,192 @@
+#include <string>
+#include <vector>
+#include <future>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+#include <endian.h>
+
+#include "pipeline.hpp"
+#include "test.hpp"
+#include "tls.hpp"
+
+namespace {
+    std::vector<int8_t> bytes(const std::string& string) {
+        return std::vector<int8_t>(string.begin(), string.end());
+    }
+
+    std::string text(const std::vector<int8_t>& buffer) {
+        return std::string(buffer.begin(), buffer.end());
+    }
+
+    // Frames fed in one byte at a time come out whole, in order, and nothing else does.
+    void framing() {
+        std::vector<int8_t> wire;
+
+        for (uint64_t id : {uint64_t(1), uint64_t(2), uint64_t(1) << 40}) {
+            std::vector<int8_t> frame = libsocket::utils::pipeline::frame(id, bytes("payload " + std::to_string(id)));
+
+            wire.insert(wire.end(), frame.begin(), frame.end());
+        }
+
+        std::vector<int8_t> empty = libsocket::utils::pipeline::frame(7, {});
+
+        CHECK(empty.size() == libsocket::utils::pipeline::header_size);
+
+        wire.insert(wire.end(), empty.begin(), empty.end());
+
+        std::vector<std::pair<uint64_t, std::string>> frames;
+        std::vector<int8_t> buffer;
+
+        for (int8_t byte : wire) {
+            buffer.push_back(byte);
+
+            libsocket::utils::pipeline::parse(buffer, [&](uint64_t id, std::vector<int8_t> payload) {
+                frames.emplace_back(id, text(payload));
+            });
+        }
+
+        CHECK(buffer.empty());
+        CHECK(frames.size() == 4);
+        CHECK(frames[0] == std::make_pair(uint64_t(1), std::string("payload 1")));
+        CHECK(frames[1] == std::make_pair(uint64_t(2), std::string("payload 2")));
+        CHECK(frames[2] == std::make_pair(uint64_t(1) << 40, "payload " + std::to_string(1ULL << 40)));
+        CHECK(frames[3] == std::make_pair(uint64_t(7), std::string()));
+    }
+
+    void oversized_frame() {
+        std::vector<int8_t> buffer(libsocket::utils::pipeline::header_size, 0);
+        uint32_t size = htobe32(libsocket::utils::pipeline::max_frame + 1);
+
+        std::memcpy(buffer.data(), &size, sizeof(size));
+
+        CHECK_THROWS(libsocket::utils::pipeline::parse(buffer, [](uint64_t, std::vector<int8_t>) {}));
+    }
+
+    // More requests than `max_inflight`, plus frames larger than one read, all matched to
+    // the right response.
+    void round_trip() {
+        auto [client, server] = test::tcp_pair();
+
+        std::thread peer([server = server] {
+            libsocket::pipeline::serve(server, [](std::vector<int8_t> payload) {
+                std::reverse(payload.begin(), payload.end());
+
+                return payload;
+            });
+        });
+
+        {
+            libsocket::pipeline p(client, false, 8);
+            std::vector<std::future<std::vector<int8_t>>> results;
+
+            for (int32_t i = 0; i < 200; i++) results.push_back(p.requeststring("request " + std::to_string(i)));
+
+            for (int32_t i = 0; i < 200; i++) {
+                std::string expected = "request " + std::to_string(i);
+
+                std::reverse(expected.begin(), expected.end());
+
+                CHECK(text(results[i].get()) == expected);
+            }
+
+            std::vector<int8_t> large(300 << 10);
+
+            for (size_t i = 0; i < large.size(); i++) large[i] = static_cast<int8_t>(i % 253);
+
+            std::vector<int8_t> reply = p.request(large).get();
+
+            std::reverse(large.begin(), large.end());
+
+            CHECK(reply == large);
+            CHECK(p.inflight() == 0);
+        }
+
+        libsocket::close(client);
+        peer.join();
+        libsocket::close(server);
+    }
+
+    // A payload the peer would refuse is rejected before anything is written.
+    void oversized_request() {
+        auto [client, server] = test::tcp_pair();
+
+        std::thread peer([server = server] {
+            libsocket::pipeline::serve(server, [](std::vector<int8_t> payload) { return payload; });
+        });
+
+        {
+            libsocket::pipeline p(client, false, 8);
+
+            CHECK_THROWS(p.request(std::vector<int8_t>(libsocket::utils::pipeline::max_frame + 1)));
+            CHECK(p.inflight() == 0);
+            CHECK(text(p.requeststring("still open").get()) == "still open");
+        }
+
+        libsocket::close(client);
+        peer.join();
+        libsocket::close(server);
+    }
+
+    // close_notify ends a TLS pipeline even while the TCP connection stays open.
+    void tls_close_notify() {
+        fixture::tls_state state = fixture::make_tls();
+        auto [client, server] = test::tcp_pair();
+
+        std::thread handshake([server = server, &state] {
+            libsocket::ssl::enable(server, state.server_ctx);
+            libsocket::ssl::handshake(server);
+        });
+
+        libsocket::ssl::enable(client, state.client_ctx);
+        libsocket::ssl::handshake(client);
+        handshake.join();
+
+        libsocket::pipeline p(client, true, 8);
+        std::future<std::vector<int8_t>> pending = p.requeststring("never answered");
+
+        {
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            SSL_shutdown(libsocket::ssl_conn_table.at(server.id));
+        }
+
+        CHECK_THROWS(pending.get());
+
+        p.close();
+
+        libsocket::ssl::shutdown(client);
+        libsocket::ssl::shutdown(server);
+        libsocket::close(client);
+        libsocket::close(server);
+    }
+
+    // The peer hanging up fails what is in flight and every later request.
+    void peer_close() {
+        auto [client, server] = test::tcp_pair();
+
+        libsocket::pipeline p(client, false, 8);
+        std::future<std::vector<int8_t>> pending = p.requeststring("never answered");
+
+        CHECK(!libsocket::read(server, 64).empty());
+
+        libsocket::close(server);
+
+        CHECK_THROWS(pending.get());
+        CHECK_THROWS(p.requeststring("too late"));
+
+        p.close();
+        libsocket::close(client);
+    }
+}
+
+int main() {
+    test::run("framing", framing);
+    test::run("oversized_frame", oversized_frame);
+    test::run("round_trip", round_trip);
+    test::run("oversized_request", oversized_request);
+    test::run("tls_close_notify", tls_close_notify);
+    test::run("peer_close", peer_close);
+}
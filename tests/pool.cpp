@@ -0,0 +1,160 @@
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <stdexcept>
+#include <cstdint>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "pool.hpp"
+#include "test.hpp"
+
+namespace {
+    uint64_t total(const std::vector<libsocket::worker_stats>& stats, uint64_t libsocket::worker_stats::*field) {
+        uint64_t sum = 0;
+
+        for (const libsocket::worker_stats& s : stats) sum += s.*field;
+
+        return sum;
+    }
+
+    template <typename Pred>
+    bool eventually(Pred pred) {
+        for (int32_t i = 0; i < 200; i++) {
+            if (pred()) return true;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+
+        return false;
+    }
+
+    // Two slow connections owned by worker 0 turn readable together: the idle worker 1
+    // steals one instead of waiting behind the other.
+    void stealing() {
+        libsocket::worker_pool pool(2, false);
+        std::atomic<int32_t> done{0};
+
+        auto slow = [&](libsocket::descriptor desc) {
+            libsocket::read(desc, 1);
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(30));
+
+            done++;
+
+            return true;
+        };
+
+        std::vector<std::pair<libsocket::descriptor, libsocket::descriptor>> pairs;
+
+        for (int32_t i = 0; i < 4; i++) {
+            pairs.push_back(test::tcp_pair());
+            pool.add(pairs.back().second, slow);
+        }
+
+        // Connections 0 and 2 went to worker 0. Retry a few rounds in case the scheduler
+        // let worker 0 see the writes one at a time.
+        for (int32_t round = 1; round <= 5 && total(pool.stats(), &libsocket::worker_stats::stolen) == 0; round++) {
+            libsocket::writestring(pairs[0].first, "x");
+            libsocket::writestring(pairs[2].first, "x");
+
+            CHECK(eventually([&] { return done == round * 2; }));
+        }
+
+        CHECK(total(pool.stats(), &libsocket::worker_stats::stolen) > 0);
+
+        pool.stop();
+
+        for (auto& [client, server] : pairs) {
+            libsocket::close(client);
+            libsocket::close(server);
+        }
+    }
+
+    // A handler that throws costs its descriptor, which the pool closes and counts.
+    void throwing_handler() {
+        libsocket::worker_pool pool(1, false);
+        auto [client, server] = test::tcp_pair();
+
+        pool.add(server, [](libsocket::descriptor desc) -> bool {
+            libsocket::read(desc, 1);
+
+            throw std::runtime_error("handler failed");
+        });
+
+        libsocket::writestring(client, "x");
+
+        CHECK(eventually([&] { return pool.stats()[0].failed == 1; }));
+        CHECK(pool.stats()[0].handled == 1);
+        CHECK(libsocket::read(client, 1).empty());
+        CHECK_THROWS(libsocket::read(server, 1));
+
+        pool.stop();
+        libsocket::close(client);
+    }
+
+    // Out of descriptors, serve() counts the failed accepts and pauses instead of spinning,
+    // then picks the backlog up once descriptors are free again.
+    void accept_errors() {
+        libsocket::descriptor listener = libsocket::ipv4::tcp::socket();
+
+        libsocket::bind(listener, libsocket::address(127, 0, 0, 1, 0));
+        libsocket::listen(listener, 16);
+
+        libsocket::address addr = libsocket::utils::getsockname(listener);
+        libsocket::worker_pool pool(1, false);
+        std::atomic<int32_t> served{0};
+
+        pool.serve(listener, [&](libsocket::descriptor client) {
+            served++;
+            libsocket::close(client);
+
+            return false;
+        });
+
+        std::vector<int32_t> spare;
+
+        for (int32_t fd = ::dup(STDIN_FILENO); fd != -1; fd = ::dup(STDIN_FILENO)) spare.push_back(fd);
+
+        // The peer needs descriptors of its own, so it runs in a child.
+        pid_t child = ::fork();
+
+        if (child == 0) {
+            for (int32_t fd : spare) ::close(fd);
+
+            libsocket::descriptor peer = libsocket::ipv4::tcp::socket();
+
+            libsocket::connect(peer, addr);
+            libsocket::writestring(peer, "x");
+
+            ::sleep(2);
+            ::_exit(0);
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(350));
+
+        uint64_t errors = pool.stats()[0].accept_errors;
+
+        // A spinning listener would fail thousands of times in 350 ms.
+        CHECK(errors >= 1 && errors <= 5);
+        CHECK(served == 0);
+
+        for (int32_t fd : spare) ::close(fd);
+
+        CHECK(eventually([&] { return served == 1; }));
+
+        ::kill(child, SIGKILL);
+        ::waitpid(child, nullptr, 0);
+
+        pool.stop();
+        libsocket::close(listener);
+    }
+}
+
+int main() {
+    test::run("stealing", stealing);
+    test::run("throwing_handler", throwing_handler);
+    test::run("accept_errors", accept_errors);
+}
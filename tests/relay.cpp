@@ -0,0 +1,111 @@
+#include <string>
+#include <vector>
+#include <thread>
+#include <cstdint>
+
+#include <sys/socket.h>
+
+#include "ssl.hpp"
+#include "relay.hpp"
+#include "test.hpp"
+#include "tls.hpp"
+
+namespace {
+    constexpr uint64_t request_size = 3 << 20;
+    constexpr uint64_t reply_size = 2 << 20;
+
+    // Ends our sending direction only: close_notify first on a TLS connection, then FIN.
+    void half_close(libsocket::descriptor desc, bool tls) {
+        std::unique_lock lock = libsocket::utils::lock_table();
+
+        if (tls) SSL_shutdown(libsocket::ssl_conn_table.at(desc.id));
+
+        ::shutdown(libsocket::socket_table.at(desc.id).fd, SHUT_WR);
+    }
+
+    void write_all(libsocket::descriptor desc, const std::vector<int8_t>& buffer, bool tls) {
+        size_t sent = 0;
+
+        while (sent < buffer.size()) {
+            int64_t n = tls ? libsocket::ssl::write(desc, buffer.data() + sent, buffer.size() - sent) : libsocket::write(desc, buffer.data() + sent, buffer.size() - sent);
+
+            CHECK(n > 0);
+
+            sent += n;
+        }
+    }
+
+    uint64_t read_all(libsocket::descriptor desc, bool tls) {
+        uint64_t got = 0;
+
+        while (true) {
+            std::vector<int8_t> buffer = tls ? libsocket::ssl::read(desc, 65536) : libsocket::read(desc, 65536);
+
+            if (buffer.empty()) return got;
+
+            got += buffer.size();
+        }
+    }
+
+    // client -> [a relay b] -> backend. The client half-closes after its request; the
+    // backend only answers once it has seen that EOF, so the reply has to travel back
+    // through a relay whose other direction is already finished.
+    void half_close_through(bool tls) {
+        fixture::tls_state state;
+
+        if (tls) state = fixture::make_tls();
+
+        auto [client, a] = test::tcp_pair();
+        auto [b, backend] = test::tcp_pair();
+
+        std::thread upstream([backend = backend] {
+            CHECK(read_all(backend, false) == request_size);
+
+            write_all(backend, std::vector<int8_t>(reply_size, 'r'), false);
+
+            libsocket::close(backend);
+        });
+
+        libsocket::relay_result result{};
+
+        std::thread proxy([&, a = a, b = b] {
+            if (tls) {
+                libsocket::ssl::enable(a, state.server_ctx);
+                libsocket::ssl::handshake(a);
+            }
+
+            result = libsocket::relay(a, b);
+        });
+
+        if (tls) {
+            libsocket::ssl::enable(client, state.client_ctx);
+            libsocket::ssl::handshake(client);
+        }
+
+        write_all(client, std::vector<int8_t>(request_size, 'q'), tls);
+        half_close(client, tls);
+
+        CHECK(read_all(client, tls) == reply_size);
+
+        upstream.join();
+        proxy.join();
+
+        CHECK(result.a_to_b == request_size);
+        CHECK(result.b_to_a == reply_size);
+        CHECK(result.error.empty());
+
+        if (tls) {
+            libsocket::ssl::shutdown(client);
+            libsocket::ssl::shutdown(a);
+        }
+
+        libsocket::close(client);
+        libsocket::close(a);
+        libsocket::close(b);
+    }
+}
+
+int main() {
+    test::run("half_close_splice", [] { half_close_through(false); });
+    test::run("half_close_tls", [] { half_close_through(true); });
+}
@@ -0,0 +1,165 @@
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+
+#include "event.hpp"
+#include "sendqueue.hpp"
+#include "test.hpp"
+
+namespace {
+    constexpr uint64_t chunk = 16 << 10;
+    constexpr uint64_t high = 64 << 10;
+    constexpr uint64_t low = 16 << 10;
+
+    int8_t pattern(uint64_t i) {
+        return static_cast<int8_t>(i * 13 % 241);
+    }
+
+    // A client whose kernel buffers fill up quickly, so writes start queueing early.
+    std::pair<libsocket::descriptor, libsocket::descriptor> small_pair() {
+        auto [client, server] = test::tcp_pair();
+
+        libsocket::utils::setsockopt<int32_t>(client, SOL_SOCKET, SO_SNDBUF, 4096);
+        libsocket::utils::setsockopt<int32_t>(server, SOL_SOCKET, SO_RCVBUF, 65536);
+
+        return {client, server};
+    }
+
+    // on_high fires once on crossing `high`, on_low once the loop drains back to `low`, and
+    // every byte reaches the peer in order.
+    void watermarks() {
+        auto [client, server] = small_pair();
+
+        libsocket::event_loop loop;
+        int32_t highs = 0;
+        int32_t lows = 0;
+        uint64_t at_low = 0;
+
+        libsocket::sendqueue::enable(client, loop, high, low, [&] { highs++; }, [&] {
+            lows++;
+            at_low = libsocket::sendqueue::queued(client);
+        });
+
+        uint64_t written = 0;
+
+        for (int32_t i = 0; i < 1024 && !highs; i++) {
+            std::vector<int8_t> buffer(chunk);
+
+            for (size_t j = 0; j < buffer.size(); j++) buffer[j] = pattern(written + j);
+
+            libsocket::sendqueue::write(client, buffer);
+            written += buffer.size();
+        }
+
+        CHECK(highs == 1);
+        CHECK(lows == 0);
+        CHECK(libsocket::sendqueue::queued(client) > high);
+
+        // Still above `high`: no second notification.
+        std::vector<int8_t> more(chunk);
+
+        for (size_t j = 0; j < more.size(); j++) more[j] = pattern(written + j);
+
+        libsocket::sendqueue::write(client, more);
+        written += more.size();
+
+        CHECK(highs == 1);
+
+        std::atomic<uint64_t> received{0};
+
+        std::thread reader([&, server = server] {
+            while (received < written) {
+                std::vector<int8_t> buffer = libsocket::read(server, 65536);
+
+                CHECK(!buffer.empty());
+
+                for (size_t j = 0; j < buffer.size(); j++) CHECK(buffer[j] == pattern(received + j));
+
+                received += buffer.size();
+            }
+        });
+
+        while (libsocket::sendqueue::queued(client)) loop.run_once(100);
+
+        reader.join();
+
+        CHECK(lows == 1);
+        CHECK(at_low <= low);
+        CHECK(received == written);
+        CHECK(libsocket::sendqueue::queued() == 0);
+
+        libsocket::sendqueue::disable(client);
+        libsocket::close(client);
+        libsocket::close(server);
+    }
+
+    // The process-wide limit refuses writes instead of queueing past it.
+    void process_limit() {
+        auto [client, server] = small_pair();
+
+        libsocket::event_loop loop;
+
+        libsocket::sendqueue::limit(high);
+        libsocket::sendqueue::enable(client, loop, high, low);
+
+        bool refused = false;
+
+        for (int32_t i = 0; i < 1024 && !refused; i++) {
+            try { libsocket::sendqueue::write(client, std::vector<int8_t>(chunk, 1)); }
+            catch (const std::runtime_error&) { refused = true; }
+        }
+
+        CHECK(refused);
+        CHECK(libsocket::sendqueue::queued() <= high);
+
+        libsocket::sendqueue::disable(client);
+
+        CHECK(libsocket::sendqueue::queued() == 0);
+
+        libsocket::sendqueue::limit(libsocket::utils::sendqueue::default_limit);
+        libsocket::close(client);
+        libsocket::close(server);
+    }
+
+    // close() without disable() still returns the bytes and unwatches the fd.
+    void close_releases() {
+        auto [client, server] = small_pair();
+
+        libsocket::event_loop loop;
+
+        libsocket::sendqueue::enable(client, loop, high, low);
+
+        for (int32_t i = 0; i < 1024 && !libsocket::sendqueue::queued(); i++) libsocket::sendqueue::write(client, std::vector<int8_t>(chunk, 1));
+
+        CHECK(libsocket::sendqueue::queued() > 0);
+        CHECK(loop.watching(client));
+
+        libsocket::close(client);
+
+        CHECK(libsocket::sendqueue::queued() == 0);
+        CHECK(!libsocket::sendqueue_table.count(client.id));
+        CHECK(!loop.watching(client));
+
+        libsocket::close(server);
+    }
+
+    void bad_watermarks() {
+        auto [client, server] = test::tcp_pair();
+
+        libsocket::event_loop loop;
+
+        CHECK_THROWS(libsocket::sendqueue::enable(client, loop, low, high));
+        CHECK_THROWS(libsocket::sendqueue::write(client, std::vector<int8_t>(1, 1)));
+
+        libsocket::close(client);
+        libsocket::close(server);
+    }
+}
+
+int main() {
+    test::run("watermarks", watermarks);
+    test::run("process_limit", process_limit);
+    test::run("close_releases", close_releases);
+    test::run("bad_watermarks", bad_watermarks);
+}
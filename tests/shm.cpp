@@ -0,0 +1,160 @@
+#include <string>
+#include <vector>
+#include <thread>
+#include <fstream>
+#include <cstdint>
+
+#include <unistd.h>
+
+#include "unix.hpp"
+#include "shm.hpp"
+#include "test.hpp"
+
+namespace {
+    int8_t pattern(uint64_t i) {
+        return static_cast<int8_t>(i * 7 % 251);
+    }
+
+    int32_t mappings() {
+        std::ifstream maps("/proc/self/maps");
+        std::string line;
+        int32_t count = 0;
+
+        while (std::getline(maps, line)) {
+            if (line.find("libsocket-shm") != std::string::npos) count++;
+        }
+
+        return count;
+    }
+
+    // Connected UNIX pair with a ring of `capacity` bytes each way: {offering, accepting}.
+    std::pair<libsocket::descriptor, libsocket::descriptor> channel(uint64_t capacity) {
+        std::string path = "/tmp/libsocket-test-shm-" + std::to_string(::getpid()) + ".sock";
+
+        libsocket::unix::unlink(path);
+
+        libsocket::descriptor listener = libsocket::unix::socket();
+
+        libsocket::bind(listener, libsocket::address(path));
+        libsocket::listen(listener, 1);
+
+        libsocket::descriptor a = libsocket::unix::socket();
+
+        libsocket::connect(a, libsocket::address(path));
+
+        libsocket::descriptor b = libsocket::accept(listener);
+
+        libsocket::close(listener);
+        libsocket::unix::unlink(path);
+
+        std::thread peer([b] { libsocket::shm::accept(b); });
+
+        libsocket::shm::offer(a, capacity);
+        peer.join();
+
+        return {a, b};
+    }
+
+    // Far more bytes than the ring holds, in chunk sizes that do not divide it, so both
+    // sides wrap around many times and every byte must come out in order.
+    void wraparound() {
+        auto [a, b] = channel(4096);
+        constexpr uint64_t total = 1 << 20;
+
+        std::thread writer([a = a] {
+            uint64_t sent = 0;
+
+            while (sent < total) {
+                std::vector<int8_t> chunk(std::min<uint64_t>(3001, total - sent));
+
+                for (size_t i = 0; i < chunk.size(); i++) chunk[i] = pattern(sent + i);
+
+                CHECK(libsocket::shm::write(a, chunk) == static_cast<int64_t>(chunk.size()));
+
+                sent += chunk.size();
+            }
+        });
+
+        uint64_t got = 0;
+
+        while (got < total) {
+            std::vector<int8_t> chunk = libsocket::shm::read(b, 1237);
+
+            CHECK(!chunk.empty());
+
+            for (size_t i = 0; i < chunk.size(); i++) CHECK(chunk[i] == pattern(got + i));
+
+            got += chunk.size();
+        }
+
+        writer.join();
+
+        CHECK(got == total);
+
+        libsocket::close(a);
+        libsocket::close(b);
+    }
+
+    void both_directions() {
+        auto [a, b] = channel(4096);
+
+        for (int32_t i = 0; i < 100; i++) {
+            std::string ping = "ping " + std::to_string(i);
+
+            CHECK(libsocket::shm::writestring(a, ping) == static_cast<int64_t>(ping.size()));
+            CHECK(libsocket::shm::readstring(b, 64) == ping);
+
+            CHECK(libsocket::shm::writestring(b, "pong") == 4);
+            CHECK(libsocket::shm::readstring(a, 64) == "pong");
+        }
+
+        libsocket::close(a);
+        libsocket::close(b);
+    }
+
+    // A closed peer hangs up the rings: reads drain what is left and then return empty,
+    // writes stop short instead of blocking.
+    void peer_close() {
+        auto [a, b] = channel(4096);
+
+        CHECK(libsocket::shm::writestring(a, "last words") == 10);
+
+        libsocket::close(a);
+
+        CHECK(libsocket::shm::readstring(b, 64) == "last words");
+        CHECK(libsocket::shm::read(b, 64).empty());
+        CHECK(libsocket::shm::write(b, std::vector<int8_t>(10000, 1)) < 10000);
+
+        libsocket::close(b);
+    }
+
+    void invalid_offer() {
+        auto [a, b] = test::tcp_pair();
+
+        CHECK_THROWS(libsocket::shm::offer(a, 4096));
+
+        libsocket::close(a);
+        libsocket::close(b);
+
+        libsocket::descriptor u = libsocket::unix::socket();
+
+        CHECK_THROWS(libsocket::shm::offer(u, 5000));
+        CHECK_THROWS(libsocket::shm::offer(u, 1024));
+
+        libsocket::close(u);
+    }
+
+    // Run last: every channel above was closed without shm::shutdown().
+    void no_leaks() {
+        CHECK(libsocket::shm_conn_table.empty());
+        CHECK(mappings() == 0);
+    }
+}
+
+int main() {
+    test::run("wraparound", wraparound);
+    test::run("both_directions", both_directions);
+    test::run("peer_close", peer_close);
+    test::run("invalid_offer", invalid_offer);
+    test::run("no_leaks", no_leaks);
+}
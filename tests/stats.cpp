@@ -0,0 +1,64 @@
+#include <sys/socket.h>
+
+#include "stats.hpp"
+#include "test.hpp"
+
+// Built twice: as `stats`, and as `stats_off` with LIBSOCKET_NO_STATS, where every
+// counter must stay zero.
+namespace {
+#ifndef LIBSOCKET_NO_STATS
+    constexpr bool enabled = true;
+#else
+    constexpr bool enabled = false;
+#endif
+
+    // Reads, writes, EAGAIN and accepts land in both the descriptor's counters and the
+    // process-wide snapshot.
+    void counters() {
+        libsocket::stats::snapshot_t before = libsocket::stats::snapshot();
+
+        auto [client, server] = test::tcp_pair();
+
+        libsocket::writestring(client, "hello");
+
+        CHECK(libsocket::read(server, 5).size() == 5);
+        CHECK(libsocket::read(server, 5, MSG_DONTWAIT).empty());
+
+        libsocket::stats::snapshot_t one = libsocket::stats::snapshot(server);
+        libsocket::stats::snapshot_t all = libsocket::stats::snapshot();
+
+        if (enabled) {
+            CHECK(one.read_calls == 2);
+            CHECK(one.read_bytes == 5);
+            CHECK(one.eagain == 1);
+            CHECK(libsocket::stats::snapshot(client).write_bytes == 5);
+
+            CHECK(all.read_bytes - before.read_bytes == 5);
+            CHECK(all.write_bytes - before.write_bytes == 5);
+            CHECK(all.accepts - before.accepts == 1);
+        }
+
+        else {
+            CHECK(one.read_calls == 0 && one.read_bytes == 0 && one.eagain == 0);
+            CHECK(all.read_calls == 0 && all.write_bytes == 0 && all.accepts == 0);
+        }
+
+        libsocket::close(client);
+        libsocket::close(server);
+    }
+
+    // A failed call counts as an error.
+    void errors() {
+        libsocket::descriptor sock = libsocket::ipv4::tcp::socket();
+
+        CHECK_THROWS(libsocket::accept(sock));
+        CHECK(libsocket::stats::snapshot(sock).errors == (enabled ? 1 : 0));
+
+        libsocket::close(sock);
+    }
+}
+
+int main() {
+    test::run("counters", counters);
+    test::run("errors", errors);
+}
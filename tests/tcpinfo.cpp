@@ -0,0 +1,68 @@
+#include <cstdint>
+
+#include <netinet/tcp.h>
+
+#include "tcpinfo.hpp"
+#include "udp.hpp"
+#include "test.hpp"
+
+namespace {
+    int32_t buffer_size(libsocket::descriptor desc, int32_t optname) {
+        int32_t size = 0;
+
+        libsocket::utils::getsockopt(desc, SOL_SOCKET, optname, size);
+
+        return size;
+    }
+
+    // An established loopback connection reports sane metrics, and bytes show up in them.
+    void metrics() {
+        auto [client, server] = test::tcp_pair();
+
+        libsocket::writestring(client, "hello");
+        CHECK(libsocket::read(server, 5).size() == 5);
+
+        libsocket::tcp_metrics m = libsocket::tcp_info(server);
+
+        CHECK(m.state == TCP_ESTABLISHED);
+        CHECK(m.mss > 0);
+        CHECK(m.bytes_received == 5);
+
+        libsocket::descriptor udp = libsocket::ipv4::udp::socket();
+
+        CHECK_THROWS(libsocket::tcp_info(udp));
+
+        for (libsocket::descriptor d : {client, server, udp}) libsocket::close(d);
+    }
+
+    // An idle connection is shrunk to min_bytes (the kernel reports it doubled), and the
+    // timer cancels itself once the descriptor is closed.
+    void adapt_idle() {
+        auto [client, server] = test::tcp_pair();
+
+        libsocket::event_loop loop;
+        libsocket::buffer_policy policy;
+        policy.interval_ms = 5;
+        policy.min_bytes = 40000;
+
+        libsocket::adapt_buffers(loop, server, policy);
+
+        // The first tick sees the handshake bytes; the second finds nothing new.
+        CHECK(loop.run_once(100) == 1);
+        CHECK(loop.run_once(100) == 1);
+        CHECK(buffer_size(server, SO_SNDBUF) == 80000);
+        CHECK(buffer_size(server, SO_RCVBUF) == 80000);
+
+        libsocket::close(server);
+
+        CHECK(loop.run_once(100) == 1);
+        CHECK(loop.run_once(20) == 0);
+
+        libsocket::close(client);
+    }
+}
+
+int main() {
+    test::run("metrics", metrics);
+    test::run("adapt_idle", adapt_idle);
+}
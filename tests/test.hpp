@@ -0,0 +1,55 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <utility>
+#include <stdexcept>
+#include <cstdlib>
+
+#include "socket.hpp"
+#include "tcp.hpp"
+#include "common.hpp"
+#include "utils.hpp"
+
+// A failed check prints where it failed and ends the test with a non-zero status.
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+            std::exit(1); \
+        } \
+    } while (0)
+
+#define CHECK_THROWS(expr) \
+    do { \
+        bool thrown = false; \
+        try { expr; } \
+        catch (const std::exception&) { thrown = true; } \
+        CHECK(thrown && #expr); \
+    } while (0)
+
+namespace test {
+    // Connected loopback TCP pair: {client, server}.
+    std::pair<libsocket::descriptor, libsocket::descriptor> tcp_pair() {
+        libsocket::descriptor listener = libsocket::ipv4::tcp::socket();
+
+        libsocket::bind(listener, libsocket::address(127, 0, 0, 1, 0));
+        libsocket::listen(listener, 1);
+
+        libsocket::descriptor client = libsocket::ipv4::tcp::socket();
+
+        libsocket::connect(client, libsocket::utils::getsockname(listener));
+
+        libsocket::descriptor server = libsocket::accept(listener);
+
+        libsocket::close(listener);
+
+        return {client, server};
+    }
+
+    template <typename Fn>
+    void run(const char* name, Fn fn) {
+        fn();
+
+        std::cout << name << ": ok" << std::endl;
+    }
+}
@@ -0,0 +1,126 @@
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+
+#include <linux/net_tstamp.h>
+
+#include "timestamp.hpp"
+#include "udp.hpp"
+#include "test.hpp"
+
+namespace {
+    int64_t now_ns() {
+        return libsocket::utils::timestamping::now_ns();
+    }
+
+    // Transmit completions arrive asynchronously; collect them until `stages` are in.
+    std::vector<libsocket::tx_timestamp> wait_tx(libsocket::descriptor desc, size_t stages) {
+        std::vector<libsocket::tx_timestamp> result;
+
+        for (int32_t i = 0; i < 100 && result.size() < stages; i++) {
+            std::vector<libsocket::tx_timestamp> more = libsocket::tx_timestamps(desc);
+
+            result.insert(result.end(), more.begin(), more.end());
+
+            if (result.size() < stages) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+
+        return result;
+    }
+
+    // A datagram carries its kernel receive time, which falls between the send and the
+    // moment readfrom_timestamped() returned.
+    void udp_rx() {
+        libsocket::descriptor sender = libsocket::ipv4::udp::socket();
+        libsocket::descriptor receiver = libsocket::ipv4::udp::socket();
+
+        libsocket::bind(receiver, libsocket::address(127, 0, 0, 1, 0));
+        libsocket::timestamping(receiver);
+
+        int64_t sent = now_ns();
+
+        libsocket::writestringto(sender, "ping", libsocket::utils::getsockname(receiver));
+
+        libsocket::timestamped_datagram d = libsocket::readfrom_timestamped(receiver, 64);
+
+        CHECK(d.data.size() == 4);
+        CHECK(d.rx.hardware_ns == 0);
+        CHECK(d.rx.software_ns >= sent);
+        CHECK(d.rx.software_ns <= d.user_ns);
+
+        libsocket::histogram delay;
+        libsocket::record_rx(delay, d);
+
+        CHECK(delay.count() == 1);
+
+        libsocket::close(sender);
+        libsocket::close(receiver);
+    }
+
+    // Each datagram gets scheduled and sent stamps, numbered from 0 after timestamping().
+    void udp_tx() {
+        libsocket::descriptor sender = libsocket::ipv4::udp::socket();
+        libsocket::descriptor receiver = libsocket::ipv4::udp::socket();
+
+        libsocket::bind(receiver, libsocket::address(127, 0, 0, 1, 0));
+        libsocket::timestamping(sender);
+
+        int64_t sent = now_ns();
+
+        libsocket::writestringto(sender, "one", libsocket::utils::getsockname(receiver));
+        libsocket::writestringto(sender, "two", libsocket::utils::getsockname(receiver));
+
+        std::vector<libsocket::tx_timestamp> stamps = wait_tx(sender, 4);
+        libsocket::histogram delay;
+
+        CHECK(stamps.size() == 4);
+
+        for (uint32_t id : {0u, 1u}) {
+            for (uint32_t stage : {static_cast<uint32_t>(SCM_TSTAMP_SCHED), static_cast<uint32_t>(SCM_TSTAMP_SND)}) {
+                bool found = false;
+
+                for (libsocket::tx_timestamp& tx : stamps) found = found || (tx.id == id && tx.stage == stage && tx.ts.ns() >= sent);
+
+                CHECK(found);
+            }
+        }
+
+        for (libsocket::tx_timestamp& tx : stamps) libsocket::record_tx(delay, tx, sent);
+
+        CHECK(delay.count() == 4);
+
+        libsocket::close(sender);
+        libsocket::close(receiver);
+    }
+
+    // On TCP the id is the offset of a write's last byte, and the peer's ACK is stamped too.
+    void tcp() {
+        auto [client, server] = test::tcp_pair();
+
+        libsocket::timestamping(client);
+        libsocket::timestamping(server);
+
+        libsocket::writestring(client, "hello");
+
+        libsocket::timestamped read = libsocket::read_timestamped(server, 5);
+
+        CHECK(read.data.size() == 5);
+        CHECK(read.rx.software_ns > 0 && read.rx.software_ns <= read.user_ns);
+
+        bool acked = false;
+
+        for (libsocket::tx_timestamp& tx : wait_tx(client, 3)) acked = acked || (tx.id == 4 && tx.stage == SCM_TSTAMP_ACK);
+
+        CHECK(acked);
+
+        libsocket::close(client);
+        libsocket::close(server);
+    }
+}
+
+int main() {
+    test::run("udp_rx", udp_rx);
+    test::run("udp_tx", udp_tx);
+    test::run("tcp", tcp);
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+
+#include "ssl.hpp"
+
+// TLS contexts with a throwaway self-signed certificate, shared by the tests and the bench.
+namespace fixture {
+    struct tls_state {
+        libsocket::ssl_ctx server_ctx = nullptr;
+        libsocket::ssl_ctx client_ctx = nullptr;
+    };
+
+    tls_state make_tls() {
+        libsocket::utils::ssl::init();
+
+        tls_state state;
+        state.server_ctx = libsocket::utils::ssl::new_server_context();
+        state.client_ctx = libsocket::utils::ssl::new_client_context();
+
+        EVP_PKEY* key = EVP_EC_gen("prime256v1");
+        X509* cert = X509_new();
+
+        X509_set_version(cert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+        X509_set_pubkey(cert, key);
+
+        X509_NAME* name = X509_get_subject_name(cert);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+        X509_set_issuer_name(cert, name);
+        X509_sign(cert, key, EVP_sha256());
+
+        SSL_CTX_use_certificate(state.server_ctx, cert);
+        SSL_CTX_use_PrivateKey(state.server_ctx, key);
+
+        X509_free(cert);
+        EVP_PKEY_free(key);
+
+        return state;
+    }
+}
@@ -0,0 +1,79 @@
+#include <string>
+#include <thread>
+#include <cstdint>
+
+#include "trace.hpp"
+#include "test.hpp"
+
+// Built with LIBSOCKET_TRACE.
+namespace {
+    size_t count(const std::string& haystack, const std::string& needle) {
+        size_t n = 0;
+
+        for (size_t at = haystack.find(needle); at != std::string::npos; at = haystack.find(needle, at + 1)) n++;
+
+        return n;
+    }
+
+    // Calls made while tracing show up as complete events; nothing is recorded after stop().
+    void records() {
+        libsocket::trace::start();
+
+        auto [client, server] = test::tcp_pair();
+
+        libsocket::writestring(client, "hello");
+        CHECK(libsocket::read(server, 5).size() == 5);
+
+        libsocket::trace::stop();
+
+        std::string json = libsocket::trace::dump_chrome();
+
+        CHECK(json.rfind("{\"traceEvents\": [", 0) == 0);
+        CHECK(json.find("\"displayTimeUnit\": \"ns\"}") != std::string::npos);
+        CHECK(count(json, "\"name\": \"connect\"") == 1);
+        CHECK(count(json, "\"name\": \"accept\"") == 1);
+        CHECK(count(json, "\"name\": \"write\"") == 1);
+        CHECK(json.find("\"name\": \"read\", \"cat\": \"libsocket\", \"ph\": \"X\"") != std::string::npos);
+        CHECK(json.find("\"args\": {\"descriptor\": " + std::to_string(server.id) + "}") != std::string::npos);
+
+        libsocket::writestring(client, "hello");
+        CHECK(libsocket::read(server, 5).size() == 5);
+
+        CHECK(libsocket::trace::dump_chrome() == json);
+
+        libsocket::close(client);
+        libsocket::close(server);
+    }
+
+    // A ring keeps only the latest events of its thread. The dump skips the oldest slot of a
+    // full ring, which the next emit() would overwrite.
+    void wraparound() {
+        uint64_t total = libsocket::trace::ring_size + 10;
+
+        for (uint64_t i = 0; i < total; i++) libsocket::trace::emit(libsocket::trace::event::read, 1, i * 1000, 1);
+
+        std::string json = libsocket::trace::dump_chrome();
+
+        CHECK(count(json, "\"ph\": \"X\"") == libsocket::trace::ring_size - 1);
+        CHECK(json.find("\"ts\": 10.000,") == std::string::npos);
+        CHECK(json.find("\"ts\": 11.000,") != std::string::npos);
+        CHECK(json.find("\"ts\": " + std::to_string(total - 1) + ".000,") != std::string::npos);
+    }
+
+    // An exited thread's ring is handed to the next new thread instead of growing the pool.
+    void ring_reuse() {
+        std::thread([] { libsocket::trace::emit(libsocket::trace::event::write, 1, 0, 1); }).join();
+
+        size_t rings = libsocket::trace::rings.size();
+
+        std::thread([] { libsocket::trace::emit(libsocket::trace::event::write, 1, 0, 1); }).join();
+
+        CHECK(libsocket::trace::rings.size() == rings);
+    }
+}
+
+int main() {
+    test::run("records", records);
+    test::run("wraparound", wraparound);
+    test::run("ring_reuse", ring_reuse);
+}
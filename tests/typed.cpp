@@ -0,0 +1,67 @@
+#include <string>
+
+#include "typed.hpp"
+#include "test.hpp"
+
+namespace {
+    // A typed listener handed to socket_table keeps its state and accepts through the
+    // descriptor API; the typed object no longer owns the fd.
+    void adopt_listener() {
+        libsocket::tcp4_stream typed;
+
+        typed.bind(libsocket::address(127, 0, 0, 1, 0));
+        typed.listen(1);
+
+        libsocket::descriptor listener = libsocket::adopt(std::move(typed));
+
+        CHECK(typed.fd() == -1);
+        CHECK(libsocket::socket_table.at(listener.id).listen);
+        CHECK(libsocket::socket_table.at(listener.id).working);
+
+        libsocket::tcp4_stream client;
+
+        client.connect(libsocket::utils::getsockname(listener));
+
+        libsocket::descriptor server = libsocket::accept(listener);
+
+        client.writestring("typed");
+
+        CHECK(libsocket::readstring(server, 5) == "typed");
+
+        libsocket::writestring(server, "table");
+
+        CHECK(client.readstring(5) == "table");
+
+        for (libsocket::descriptor d : {listener, server}) libsocket::close(d);
+    }
+
+    // An accepted typed socket keeps its peer address and accepted flag through adopt().
+    void adopt_accepted() {
+        libsocket::tcp4_stream listener;
+
+        listener.bind(libsocket::address(127, 0, 0, 1, 0));
+        listener.listen(1);
+
+        sockaddr_storage local{};
+        socklen_t size = sizeof(local);
+
+        CHECK(::getsockname(listener.fd(), reinterpret_cast<sockaddr*>(&local), &size) == 0);
+
+        libsocket::descriptor client = libsocket::ipv4::tcp::socket();
+
+        libsocket::connect(client, libsocket::address::from_sockaddr(local));
+
+        libsocket::descriptor server = libsocket::adopt(listener.accept());
+        libsocket::utils::socket& sock = libsocket::socket_table.at(server.id);
+
+        CHECK(sock.accepted);
+        CHECK(sock.raddress.port() == libsocket::utils::getsockname(client).port());
+
+        for (libsocket::descriptor d : {client, server}) libsocket::close(d);
+    }
+}
+
+int main() {
+    test::run("adopt_listener", adopt_listener);
+    test::run("adopt_accepted", adopt_accepted);
+}
@@ -0,0 +1,8 @@
+#include "typed.hpp"
+
+// Must not compile: readfrom() is datagram-only. Built only by the typed_misuse test.
+int main() {
+    libsocket::tcp4_stream s;
+
+    s.readfrom(10);
+}
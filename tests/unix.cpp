@@ -0,0 +1,120 @@
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "unix.hpp"
+#include "test.hpp"
+
+namespace {
+    // Connected UNIX pair: {sender, receiver}.
+    std::pair<libsocket::descriptor, libsocket::descriptor> channel() {
+        std::string path = "/tmp/libsocket-test-unix-" + std::to_string(::getpid()) + ".sock";
+
+        libsocket::unix::unlink(path);
+
+        libsocket::descriptor listener = libsocket::unix::socket();
+
+        libsocket::bind(listener, libsocket::address(path));
+        libsocket::listen(listener, 1);
+
+        libsocket::descriptor a = libsocket::unix::socket();
+
+        libsocket::connect(a, libsocket::address(path));
+
+        libsocket::descriptor b = libsocket::accept(listener);
+
+        libsocket::close(listener);
+        libsocket::unix::unlink(path);
+
+        return {a, b};
+    }
+
+    size_t open_fds() {
+        size_t count = 0;
+
+        for ([[maybe_unused]] const auto& entry : std::filesystem::directory_iterator("/proc/self/fd")) count++;
+
+        return count;
+    }
+
+    // A TCP connection handed over the channel still talks to the same peer.
+    void handoff() {
+        auto [a, b] = channel();
+        auto [client, server] = test::tcp_pair();
+
+        libsocket::unix::send_descriptors(a, {server}, {'h', 'i'});
+        libsocket::close(server);
+
+        libsocket::descriptor_message message = libsocket::unix::recv_descriptors(b);
+
+        CHECK(message.descriptors.size() == 1);
+        CHECK(message.data == std::vector<int8_t>({'h', 'i'}));
+
+        libsocket::write(message.descriptors[0], {'o', 'k'});
+
+        CHECK(libsocket::read(client, 2) == std::vector<int8_t>({'o', 'k'}));
+
+        for (libsocket::descriptor d : {a, b, client, message.descriptors[0]}) libsocket::close(d);
+    }
+
+    // A message larger than the socket buffer on a non-blocking channel is still sent whole.
+    void nonblocking_full_channel() {
+        auto [a, b] = channel();
+        auto [client, server] = test::tcp_pair();
+
+        std::vector<int8_t> payload(libsocket::utils::unix::max_payload);
+
+        for (size_t i = 0; i < payload.size(); i++) payload[i] = static_cast<int8_t>(i % 251);
+
+        libsocket::utils::set_blocking(a, false);
+
+        std::thread sender([a = a, server = server, &payload] { libsocket::unix::send_descriptors(a, {server}, payload); });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        libsocket::descriptor_message message = libsocket::unix::recv_descriptors(b);
+
+        sender.join();
+
+        CHECK(message.descriptors.size() == 1);
+        CHECK(message.data == payload);
+
+        for (libsocket::descriptor d : {a, b, client, server, message.descriptors[0]}) libsocket::close(d);
+    }
+
+    // The sender dies after the header and its descriptor: the received descriptor must not leak.
+    void failed_recv_closes_fds() {
+        auto [a, b] = channel();
+
+        size_t before = open_fds();
+
+        libsocket::utils::unix::handoff_header header{10, 1};
+        std::vector<int8_t> buffer(sizeof(header));
+
+        std::memcpy(buffer.data(), &header, sizeof(header));
+
+        libsocket::fd_t extra = ::dup(STDOUT_FILENO);
+
+        libsocket::utils::unix::send_fds(libsocket::socket_table.at(a.id).fd, {extra}, buffer);
+
+        ::close(extra);
+        libsocket::close(a);
+
+        CHECK_THROWS(libsocket::unix::recv_descriptors(b));
+        CHECK(open_fds() == before - 1);
+
+        libsocket::close(b);
+    }
+}
+
+int main() {
+    test::run("handoff", handoff);
+    test::run("nonblocking_full_channel", nonblocking_full_channel);
+    test::run("failed_recv_closes_fds", failed_recv_closes_fds);
+}
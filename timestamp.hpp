@@ -0,0 +1,242 @@
+#pragma once
+#include <vector>
+#include <stdexcept>
+#include <mutex>
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+#include "def.hpp"
+#include "socket.hpp"
+#include "address.hpp"
+#include "utils.hpp"
+#include "histogram.hpp"
+
+namespace libsocket {
+    // Kernel timestamps in CLOCK_REALTIME nanoseconds; 0 when the kernel did not provide one.
+    struct timestamp {
+        int64_t software_ns = 0;
+        int64_t hardware_ns = 0;
+
+        int64_t ns() const { return hardware_ns ? hardware_ns : software_ns; }
+    };
+
+    struct timestamped {
+        std::vector<int8_t> data;
+        timestamp rx;
+        int64_t user_ns;
+    };
+
+    struct timestamped_datagram {
+        address addr;
+        std::vector<int8_t> data;
+        timestamp rx;
+        int64_t user_ns;
+    };
+
+    // `id` counts bytes written (stream) or datagrams sent (dgram) since timestamping() was
+    // enabled; `stage` is SCM_TSTAMP_SCHED, SCM_TSTAMP_SND or SCM_TSTAMP_ACK.
+    struct tx_timestamp {
+        uint32_t id;
+        uint32_t stage;
+        timestamp ts;
+    };
+
+    namespace utils::timestamping {
+        constexpr size_t control_size = 512;
+
+        int64_t now_ns() {
+            timespec ts;
+            ::clock_gettime(CLOCK_REALTIME, &ts);
+
+            return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        }
+
+        int64_t to_ns(const timespec& ts) {
+            return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        }
+
+        // ts[0] is the software timestamp, ts[2] the raw hardware one; ts[1] is unused.
+        void parse(msghdr& msg, timestamp& ts, sock_extended_err* err = nullptr) {
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                    scm_timestamping tss;
+                    std::memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+
+                    ts.software_ns = to_ns(tss.ts[0]);
+                    ts.hardware_ns = to_ns(tss.ts[2]);
+                }
+
+                else if (err && ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+                    std::memcpy(err, CMSG_DATA(cmsg), sizeof(*err));
+                }
+            }
+        }
+
+        int64_t recv(libsocket::utils::socket& sock, std::vector<int8_t>& buffer, sockaddr_storage* addr, int32_t flags, timestamp& ts) {
+            alignas(struct cmsghdr) char control[control_size];
+            iovec iov{buffer.data(), buffer.size()};
+
+            msghdr msg{};
+            msg.msg_name = addr;
+            msg.msg_namelen = addr ? sizeof(*addr) : 0;
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            int64_t received = ::recvmsg(sock.fd, &msg, flags);
+
+            libsocket::utils::count_read(sock, received);
+
+            if (received >= 0) parse(msg, ts);
+
+            return received;
+        }
+    }
+
+    // Opt-in SO_TIMESTAMPING: read_timestamped()/readfrom_timestamped() then carry the
+    // kernel receive time, and tx_timestamps() collects transmit completions from the error
+    // queue. `hardware` also asks for NIC timestamps, which only appear once the interface
+    // has hardware timestamping switched on (SIOCSHWTSTAMP).
+    void timestamping(descriptor desc, bool hardware = false) {
+        std::unique_lock lock = libsocket::utils::lock_table();
+
+        if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("timestamping(): socket closed");
+
+        libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+        uint32_t flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_SCHED |
+                         SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+        if (sock.type == SOCK_STREAM) flags |= SOF_TIMESTAMPING_TX_ACK;
+        if (hardware) flags |= SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_TX_HARDWARE;
+
+        if (::setsockopt(sock.fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == -1) throw std::runtime_error("timestamping(): Unable to set SO_TIMESTAMPING: " + std::string(strerror(errno)));
+    }
+
+    timestamped read_timestamped(descriptor desc, int64_t size, int32_t flags = 0) {
+        std::unique_lock lock = libsocket::utils::lock_table();
+
+        if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("read_timestamped(): socket closed");
+
+        libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+        libsocket::utils::pin pin(sock);
+        lock.unlock();
+
+        std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.recvMtx);
+
+        timestamped result{std::vector<int8_t>(size), {}, 0};
+        int64_t received = libsocket::utils::timestamping::recv(sock, result.data, nullptr, flags, result.rx);
+
+        result.user_ns = libsocket::utils::timestamping::now_ns();
+
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) received = 0;
+            else throw std::runtime_error("read_timestamped(): Unable to read from socket: " + std::string(strerror(errno)));
+        }
+
+        result.data.resize(received);
+
+        return result;
+    }
+
+    timestamped_datagram readfrom_timestamped(descriptor desc, int64_t size, int32_t flags = 0) {
+        std::unique_lock lock = libsocket::utils::lock_table();
+
+        if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("readfrom_timestamped(): socket closed");
+
+        libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+        libsocket::utils::pin pin(sock);
+        lock.unlock();
+
+        std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.recvMtx);
+
+        sockaddr_storage tmp_addr{};
+        tmp_addr.ss_family = sock.family;
+
+        timestamped_datagram result{address(), std::vector<int8_t>(size), {}, 0};
+        int64_t received = libsocket::utils::timestamping::recv(sock, result.data, &tmp_addr, flags, result.rx);
+
+        result.user_ns = libsocket::utils::timestamping::now_ns();
+
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) received = 0;
+            else throw std::runtime_error("readfrom_timestamped(): Unable to read from socket: " + std::string(strerror(errno)));
+        }
+
+        result.addr = address::from_sockaddr(tmp_addr);
+        result.data.resize(received);
+
+        return result;
+    }
+
+    // Drains the error queue without blocking and returns the transmit timestamps found. The
+    // queue is charged against SO_RCVBUF, so call this regularly or later entries are dropped.
+    std::vector<tx_timestamp> tx_timestamps(descriptor desc) {
+        std::unique_lock lock = libsocket::utils::lock_table();
+
+        if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("tx_timestamps(): socket closed");
+
+        libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+        libsocket::utils::pin pin(sock);
+        lock.unlock();
+
+        std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.sendMtx);
+
+        std::vector<tx_timestamp> result;
+
+        while (true) {
+            alignas(struct cmsghdr) char control[libsocket::utils::timestamping::control_size];
+
+            msghdr msg{};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            if (::recvmsg(sock.fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+                throw std::runtime_error("tx_timestamps(): Unable to read error queue: " + std::string(strerror(errno)));
+            }
+
+            timestamp ts;
+            sock_extended_err err{};
+
+            libsocket::utils::timestamping::parse(msg, ts, &err);
+
+            if (err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) result.push_back({err.ee_data, err.ee_info, ts});
+        }
+
+        return result;
+    }
+
+    // Time the data spent between the kernel and the application: from the receive timestamp
+    // to the moment read_timestamped()/readfrom_timestamped() returned.
+    void record_rx(histogram& hist, const timestamp& rx, int64_t user_ns) {
+        if (rx.ns() && user_ns >= rx.ns()) hist.record(user_ns - rx.ns());
+    }
+
+    void record_rx(histogram& hist, const timestamped& read) {
+        record_rx(hist, read.rx, read.user_ns);
+    }
+
+    void record_rx(histogram& hist, const timestamped_datagram& read) {
+        record_rx(hist, read.rx, read.user_ns);
+    }
+
+    // Time from the application's send call (`sent_ns`, taken with
+    // utils::timestamping::now_ns()) to the kernel's transmit timestamp.
+    void record_tx(histogram& hist, const tx_timestamp& tx, int64_t sent_ns) {
+        if (tx.ts.ns() && tx.ts.ns() >= sent_ns) hist.record(tx.ts.ns() - sent_ns);
+    }
+}
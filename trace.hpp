@@ -0,0 +1,230 @@
+#pragma once
+#include <string>
+#include <array>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+
+namespace libsocket::trace {
+    enum class event : uint16_t {
+        connect,
+        accept,
+        read,
+        write,
+        readfrom,
+        writeto,
+        handshake,
+        table_lock,
+        socket_lock
+    };
+
+    struct record {
+        uint64_t start_ns;
+        uint64_t duration_ns;
+        int32_t descriptor;
+        uint32_t thread;
+        uint16_t type;
+        uint16_t reserved[3];
+    };
+
+    static_assert(sizeof(record) == 32, "trace::record must stay fixed-size");
+
+    constexpr uint64_t ring_size = 1 << 14;
+    constexpr size_t record_words = sizeof(record) / sizeof(uint64_t);
+
+    // Single-producer ring written as a seqlock: records are stored word by word in relaxed
+    // atomics after a release fence, and the dumping thread re-reads `head` after an acquire
+    // fence to discard slots that may have been overwritten while it copied them.
+    struct ring {
+        std::array<std::array<std::atomic<uint64_t>, record_words>, ring_size> slots;
+        std::atomic<uint64_t> head{0};
+        uint32_t thread;
+        bool in_use = true;             // guarded by rings_mutex
+    };
+
+    // A thread's ring goes back to the pool when it exits and is handed to the next new
+    // thread, so memory is bounded by the peak thread count. Old records stay readable
+    // until overwritten; each one carries its own thread id.
+    std::list<ring> rings;
+    std::mutex rings_mutex;
+
+    std::atomic_bool enabled = false;
+
+    uint64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    struct ring_owner {
+        ring* own = nullptr;
+
+        ~ring_owner() {
+            if (!own) return;
+
+            std::unique_lock lock(rings_mutex);
+
+            own->in_use = false;
+        }
+    };
+
+    ring& local() {
+        thread_local ring_owner owner;
+
+        if (!owner.own) {
+            std::unique_lock lock(rings_mutex);
+
+            for (ring& r : rings) {
+                if (!r.in_use) {
+                    owner.own = &r;
+
+                    break;
+                }
+            }
+
+            if (!owner.own) owner.own = &rings.emplace_back();
+
+            owner.own->in_use = true;
+            owner.own->thread = ::syscall(SYS_gettid);
+        }
+
+        return *owner.own;
+    }
+
+    void start() {
+        enabled = true;
+    }
+
+    void stop() {
+        enabled = false;
+    }
+
+    void emit(event type, int32_t descriptor, uint64_t start_ns, uint64_t duration_ns) {
+        ring& own = local();
+        uint64_t head = own.head.load(std::memory_order_relaxed);
+
+        record rec{start_ns, duration_ns, descriptor, own.thread, static_cast<uint16_t>(type), {}};
+        uint64_t words[record_words];
+
+        std::memcpy(words, &rec, sizeof(rec));
+
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (size_t w = 0; w < record_words; w++) own.slots[head % ring_size][w].store(words[w], std::memory_order_relaxed);
+
+        own.head.store(head + 1, std::memory_order_release);
+    }
+
+    // Emits one complete event covering its lifetime. Without LIBSOCKET_TRACE it is an
+    // empty object, so instrumented call sites compile to nothing.
+    class scope {
+#ifdef LIBSOCKET_TRACE
+        event __type;
+        int32_t __descriptor;
+        uint64_t __start = 0;
+#endif
+    public:
+        scope([[maybe_unused]] event type, [[maybe_unused]] int32_t descriptor) {
+#ifdef LIBSOCKET_TRACE
+            if (!enabled.load(std::memory_order_relaxed)) return;
+
+            __type = type;
+            __descriptor = descriptor;
+            __start = now_ns();
+#endif
+        }
+
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+
+        ~scope() {
+#ifdef LIBSOCKET_TRACE
+            if (__start) emit(__type, __descriptor, __start, now_ns() - __start);
+#endif
+        }
+    };
+
+    void span([[maybe_unused]] event type, [[maybe_unused]] int32_t descriptor, [[maybe_unused]] std::chrono::steady_clock::time_point start) {
+#ifdef LIBSOCKET_TRACE
+        if (!enabled.load(std::memory_order_relaxed)) return;
+
+        uint64_t start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count();
+
+        emit(type, descriptor, start_ns, now_ns() - start_ns);
+#endif
+    }
+
+    std::string name(uint16_t type) {
+        switch (static_cast<event>(type)) {
+            case event::connect: return "connect";
+            case event::accept: return "accept";
+            case event::read: return "read";
+            case event::write: return "write";
+            case event::readfrom: return "readfrom";
+            case event::writeto: return "writeto";
+            case event::handshake: return "handshake";
+            case event::table_lock: return "socket_table_mutex";
+            case event::socket_lock: return "socket_mutex";
+        }
+
+        return "unknown";
+    }
+
+    std::string micros(uint64_t ns) {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%llu.%03llu", static_cast<unsigned long long>(ns / 1000), static_cast<unsigned long long>(ns % 1000));
+
+        return buffer;
+    }
+
+    // Chrome trace event format, loadable in chrome://tracing and ui.perfetto.dev.
+    void dump_chrome(std::ostream& out) {
+        std::unique_lock lock(rings_mutex);
+
+        pid_t pid = ::getpid();
+        bool first = true;
+
+        out << "{\"traceEvents\": [";
+
+        for (ring& r : rings) {
+            uint64_t head = r.head.load(std::memory_order_acquire);
+            uint64_t begin = head > ring_size ? head - ring_size : 0;
+
+            for (uint64_t i = begin; i < head; i++) {
+                uint64_t words[record_words];
+
+                for (size_t w = 0; w < record_words; w++) words[w] = r.slots[i % ring_size][w].load(std::memory_order_relaxed);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+
+                if (r.head.load(std::memory_order_relaxed) >= i + ring_size) continue;
+
+                record rec;
+                std::memcpy(&rec, words, sizeof(rec));
+
+                out << (first ? "\n" : ",\n") << "{\"name\": \"" << name(rec.type) << "\", \"cat\": \"libsocket\", \"ph\": \"X\""
+                    << ", \"ts\": " << micros(rec.start_ns) << ", \"dur\": " << micros(rec.duration_ns)
+                    << ", \"pid\": " << pid << ", \"tid\": " << rec.thread
+                    << ", \"args\": {\"descriptor\": " << rec.descriptor << "}}";
+
+                first = false;
+            }
+        }
+
+        out << "\n], \"displayTimeUnit\": \"ns\"}" << std::endl;
+    }
+
+    std::string dump_chrome() {
+        std::ostringstream out;
+        dump_chrome(out);
+
+        return out.str();
+    }
+}
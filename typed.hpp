@@ -0,0 +1,351 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <mutex>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "def.hpp"
+#include "socket.hpp"
+#include "address.hpp"
+#include "utils.hpp"
+#include "stats.hpp"
+
+#undef unix
+
+namespace libsocket {
+    namespace utils {
+        template<int32_t Family>
+        struct family_traits;
+
+        template<>
+        struct family_traits<AF_INET> {
+            using sockaddr_type = sockaddr_in;
+            static constexpr const char* name = "ipv4";
+        };
+
+        template<>
+        struct family_traits<AF_INET6> {
+            using sockaddr_type = sockaddr_in6;
+            static constexpr const char* name = "ipv6";
+        };
+
+        template<>
+        struct family_traits<AF_UNIX> {
+            using sockaddr_type = sockaddr_un;
+            static constexpr const char* name = "unix";
+        };
+
+        template<int32_t Family, int32_t Type>
+        std::string socket_label() {
+            if (Family == AF_UNIX) return std::string(Type == SOCK_STREAM ? "stream" : "dgram") + "|unix";
+
+            return std::string(Type == SOCK_STREAM ? "tcp" : "udp") + "|" + family_traits<Family>::name;
+        }
+    }
+
+    // Move-only socket that owns its fd directly, bypassing socket_table. The address
+    // layout comes from the template arguments, and stream-only or datagram-only calls
+    // fail to compile on the wrong kind of socket.
+    template<int32_t Family, int32_t Type>
+    class basic_socket {
+        using traits = libsocket::utils::family_traits<Family>;
+        using sockaddr_type = typename traits::sockaddr_type;
+
+        static constexpr socklen_t sockaddr_size = sizeof(sockaddr_type);
+        static constexpr bool stream = Type == SOCK_STREAM;
+
+        static_assert(Type == SOCK_STREAM || Type == SOCK_DGRAM, "basic_socket supports SOCK_STREAM and SOCK_DGRAM");
+
+        fd_t __fd = -1;
+
+        bool __working = false;
+        bool __listen = false;
+        bool __accepted = false;
+
+        address __laddress;
+        address __raddress;
+
+        void check(address& addr, const char* call) {
+            if (__fd == -1) throw std::runtime_error(std::string(call) + "(): socket closed");
+            if (addr.family() != Family) throw std::runtime_error(std::string(call) + "(): Invalid address family");
+        }
+
+        void check(const char* call) {
+            if (__fd == -1) throw std::runtime_error(std::string(call) + "(): socket closed");
+        }
+
+        void count_write(int64_t sent, size_t size) {
+            libsocket::stats::add(&libsocket::stats::counters::write_calls, 1);
+
+            if (sent >= 0) {
+                libsocket::stats::add(&libsocket::stats::counters::write_bytes, sent);
+
+                if (sent < static_cast<int64_t>(size)) libsocket::stats::add(&libsocket::stats::counters::short_writes, 1);
+            }
+
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) libsocket::stats::add(&libsocket::stats::counters::eagain, 1);
+            else libsocket::stats::add(&libsocket::stats::counters::errors, 1);
+        }
+
+        basic_socket(fd_t fd, address raddress) : __fd(fd), __working(true), __accepted(true), __raddress(raddress) {}
+    public:
+        basic_socket() : __fd(::socket(Family, Type, 0)) {
+            if (__fd == -1) throw std::runtime_error("socket(" + libsocket::utils::socket_label<Family, Type>() + "): Unable to open socket");
+        }
+
+        basic_socket(const basic_socket&) = delete;
+        basic_socket& operator=(const basic_socket&) = delete;
+
+        basic_socket(basic_socket&& other) noexcept {
+            *this = std::move(other);
+        }
+
+        basic_socket& operator=(basic_socket&& other) noexcept {
+            if (this != &other) {
+                close();
+
+                __fd = other.__fd;
+                __working = other.__working;
+                __listen = other.__listen;
+                __accepted = other.__accepted;
+                __laddress = other.__laddress;
+                __raddress = other.__raddress;
+
+                other.__fd = -1;
+            }
+
+            return *this;
+        }
+
+        ~basic_socket() {
+            close();
+        }
+
+        fd_t fd() const { return __fd; }
+        bool working() const { return __working; }
+        bool listening() const { return __listen; }
+        bool accepted() const { return __accepted; }
+        address laddress() const { return __laddress; }
+        address raddress() const { return __raddress; }
+
+        fd_t release() {
+            fd_t fd = __fd;
+            __fd = -1;
+
+            return fd;
+        }
+
+        void connect(address addr) {
+            check(addr, "connect");
+
+            sockaddr_type tmp_addr = addr;
+
+            if (::connect(__fd, reinterpret_cast<sockaddr*>(&tmp_addr), sockaddr_size) == -1) throw std::runtime_error("connect(): Unable to connect to host: " + std::string(strerror(errno)));
+
+            sockaddr_storage local{};
+            socklen_t addrlen = sizeof(local);
+
+            if (::getsockname(__fd, reinterpret_cast<sockaddr*>(&local), &addrlen) == 0) __laddress = address::from_sockaddr(local);
+
+            __working = true;
+            __raddress = addr;
+        }
+
+        void bind(address addr) {
+            check(addr, "bind");
+
+            sockaddr_type tmp_addr = addr;
+
+            if (::bind(__fd, reinterpret_cast<sockaddr*>(&tmp_addr), sockaddr_size) == -1) throw std::runtime_error("bind(): Unable to bind to host: " + std::string(strerror(errno)));
+
+            __working = true;
+            __laddress = addr;
+        }
+
+        void listen(int32_t backlog) {
+            static_assert(stream, "listen() requires a stream socket");
+
+            check("listen");
+
+            if (::listen(__fd, backlog) == -1) throw std::runtime_error("listen(): Unable to listen to host: " + std::string(strerror(errno)));
+
+            __listen = true;
+        }
+
+        basic_socket accept() {
+            static_assert(stream, "accept() requires a stream socket");
+
+            check("accept");
+
+            sockaddr_storage addr{};
+            socklen_t socklen = sockaddr_size;
+
+            fd_t new_fd = ::accept(__fd, reinterpret_cast<sockaddr*>(&addr), &socklen);
+
+            if (new_fd == -1) throw std::runtime_error("accept(): Unable to accept connection: " + std::string(strerror(errno)));
+
+            libsocket::stats::add(&libsocket::stats::counters::accepts, 1);
+
+            addr.ss_family = Family;
+
+            return basic_socket(new_fd, address::from_sockaddr(addr));
+        }
+
+        std::vector<int8_t> read(int64_t size, int32_t flags = 0) {
+            check("read");
+
+            std::vector<int8_t> buffer(size);
+            int64_t received = ::recv(__fd, buffer.data(), size, flags);
+
+            libsocket::stats::add(&libsocket::stats::counters::read_calls, 1);
+
+            if (received == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    libsocket::stats::add(&libsocket::stats::counters::errors, 1);
+
+                    throw std::runtime_error("read(): Unable to read from socket: " + std::string(strerror(errno)));
+                }
+
+                libsocket::stats::add(&libsocket::stats::counters::eagain, 1);
+
+                received = 0;
+            }
+
+            libsocket::stats::add(&libsocket::stats::counters::read_bytes, received);
+
+            buffer.resize(received);
+
+            return buffer;
+        }
+
+        std::string readstring(int64_t size, int32_t flags = 0) {
+            std::vector<int8_t> buffer = read(size, flags);
+
+            return std::string(buffer.begin(), buffer.end());
+        }
+
+        int64_t write(const std::vector<int8_t>& buffer, int32_t flags = 0) {
+            check("write");
+
+            int64_t sent = ::send(__fd, buffer.data(), buffer.size(), flags);
+
+            count_write(sent, buffer.size());
+
+            return sent;
+        }
+
+        int64_t writestring(std::string string, int32_t flags = 0) {
+            return write(std::vector<int8_t>(string.begin(), string.end()), flags);
+        }
+
+        datagram readfrom(int64_t size, int32_t flags = 0) {
+            static_assert(!stream, "readfrom() requires a datagram socket");
+
+            check("readfrom");
+
+            sockaddr_storage tmp_addr{};
+            socklen_t socklen = sockaddr_size;
+
+            tmp_addr.ss_family = Family;
+
+            std::vector<int8_t> buffer(size);
+            int64_t received = ::recvfrom(__fd, buffer.data(), size, flags, reinterpret_cast<sockaddr*>(&tmp_addr), &socklen);
+
+            libsocket::stats::add(&libsocket::stats::counters::read_calls, 1);
+
+            if (received == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    libsocket::stats::add(&libsocket::stats::counters::errors, 1);
+
+                    throw std::runtime_error("readfrom(): Unable to read from socket: " + std::string(strerror(errno)));
+                }
+
+                libsocket::stats::add(&libsocket::stats::counters::eagain, 1);
+
+                received = 0;
+            }
+
+            libsocket::stats::add(&libsocket::stats::counters::read_bytes, received);
+
+            buffer.resize(received);
+
+            return {address::from_sockaddr(tmp_addr), buffer};
+        }
+
+        string_datagram readstringfrom(int64_t size, int32_t flags = 0) {
+            datagram read = readfrom(size, flags);
+
+            return {read.addr, std::string(read.data.begin(), read.data.end())};
+        }
+
+        int64_t writeto(const std::vector<int8_t>& buffer, address addr, int32_t flags = 0) {
+            static_assert(!stream, "writeto() requires a datagram socket");
+
+            check(addr, "writeto");
+
+            sockaddr_type tmp_addr = addr;
+
+            int64_t sent = ::sendto(__fd, buffer.data(), buffer.size(), flags, reinterpret_cast<sockaddr*>(&tmp_addr), sockaddr_size);
+
+            count_write(sent, buffer.size());
+
+            return sent;
+        }
+
+        int64_t writestringto(std::string string, address addr, int32_t flags = 0) {
+            return writeto(std::vector<int8_t>(string.begin(), string.end()), addr, flags);
+        }
+
+        void shutdown(int32_t how = SHUT_RDWR) {
+            check("shutdown");
+
+            ::shutdown(__fd, how);
+
+            __working = false;
+        }
+
+        void close() {
+            if (__fd != -1) ::close(__fd);
+
+            __fd = -1;
+            __working = false;
+        }
+    };
+
+    using tcp4_stream = basic_socket<AF_INET, SOCK_STREAM>;
+    using tcp6_stream = basic_socket<AF_INET6, SOCK_STREAM>;
+    using udp4_socket = basic_socket<AF_INET, SOCK_DGRAM>;
+    using udp6_socket = basic_socket<AF_INET6, SOCK_DGRAM>;
+    using unix_stream = basic_socket<AF_UNIX, SOCK_STREAM>;
+
+    // Hands a typed socket over to socket_table, for code using the descriptor API.
+    template<int32_t Family, int32_t Type>
+    descriptor adopt(basic_socket<Family, Type>&& typed) {
+        bool working = typed.working();
+        bool listening = typed.listening();
+        bool accepted = typed.accepted();
+        address laddress = typed.laddress();
+        address raddress = typed.raddress();
+
+        std::unique_lock lock = libsocket::utils::lock_table();
+
+        descriptor desc = libsocket::utils::emplace_socket(typed.release(), Family, Type);
+        libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+        sock.working = working;
+        sock.listen = listening;
+        sock.accepted = accepted;
+        sock.laddress = laddress;
+        sock.raddress = raddress;
+
+        return desc;
+    }
+}
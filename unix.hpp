@@ -3,44 +3,144 @@
 #include <vector>
 #include <stdexcept>
 #include <mutex>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include "def.hpp"
 #include "socket.hpp"
 #include "address.hpp"
 #include "common.hpp"
 #include "utils.hpp"
+#include "typed.hpp"
+#include "stats.hpp"
 
 #undef unix
 
-namespace libsocket::unix {
-    descriptor socket() {
-        int32_t id = libsocket::utils::random_s32(libsocket::utils::mersenne);
-        uint64_t fingerprint = libsocket::utils::random_u64(libsocket::utils::mersenne);
+namespace libsocket {
+    struct descriptor_message {
+        std::vector<descriptor> descriptors;
+        std::vector<int8_t> data;
+    };
+}
+
+namespace libsocket::utils::unix {
+    constexpr size_t max_fds = 253; // SCM_MAX_FD
+    constexpr size_t max_payload = 1 << 20;
+
+    // Sends the whole buffer; `fds` ride as SCM_RIGHTS on its first byte. A non-blocking
+    // channel that fills up is waited on, since a half-sent message would desync the peer.
+    void send_fds(fd_t fd, const std::vector<fd_t>& fds, const std::vector<int8_t>& buffer) {
+        if (fds.size() > max_fds) throw std::runtime_error("send_fds(): Too many descriptors");
+        if (buffer.empty()) throw std::runtime_error("send_fds(): Empty buffer");
+
+        size_t sent = 0;
+
+        while (sent < buffer.size()) {
+            iovec iov{const_cast<int8_t*>(buffer.data()) + sent, buffer.size() - sent};
+            std::vector<char> control;
+
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
 
-        libsocket::utils::socket& sock = socket_table.try_emplace(id).first->second;
+            if (sent == 0 && !fds.empty()) {
+                control.resize(CMSG_SPACE(sizeof(fd_t) * fds.size()));
 
-        sock.fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
-        sock.fingerprint = fingerprint;
+                msg.msg_control = control.data();
+                msg.msg_controllen = control.size();
 
-        sock.working = false;
-        sock.blocking = true;
-        sock.listen = false;
+                cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(fd_t) * fds.size());
 
-        sock.family = AF_UNIX;
-        sock.type = SOCK_STREAM;
-        sock.sockaddr_size = sizeof(sockaddr_un);
+                std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(fd_t) * fds.size());
+            }
 
-        if (sock.fd == -1) {
-            socket_table.erase(id);
+            int64_t n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
 
-            throw std::runtime_error("socket(stream|unix): Unable to open socket");
+            if (n == -1) {
+                if (errno == EINTR) continue;
+
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    pollfd pfd{fd, POLLOUT, 0};
+
+                    if (::poll(&pfd, 1, -1) == -1 && errno != EINTR) throw std::runtime_error("send_fds(): Unable to wait for channel: " + std::string(strerror(errno)));
+
+                    continue;
+                }
+
+                throw std::runtime_error("send_fds(): Unable to send descriptors: " + std::string(strerror(errno)));
+            }
+
+            sent += n;
         }
-        
-        return {id, fingerprint};
+    }
+
+    // Fills the whole buffer and returns every descriptor attached along the way.
+    std::vector<fd_t> recv_fds(fd_t fd, std::vector<int8_t>& buffer) {
+        std::vector<fd_t> fds;
+        size_t received = 0;
+
+        auto fail = [&](std::string message) {
+            for (fd_t received_fd : fds) ::close(received_fd);
+
+            throw std::runtime_error("recv_fds(): " + message);
+        };
+
+        while (received < buffer.size()) {
+            iovec iov{buffer.data() + received, buffer.size() - received};
+            std::vector<char> control(CMSG_SPACE(sizeof(fd_t) * max_fds));
+
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+
+            int64_t n = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1) fail("Unable to receive descriptors: " + std::string(strerror(errno)));
+
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+                size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(fd_t);
+                size_t offset = fds.size();
+
+                fds.resize(offset + count);
+                std::memcpy(fds.data() + offset, CMSG_DATA(cmsg), sizeof(fd_t) * count);
+            }
+
+            if (msg.msg_flags & MSG_CTRUNC) fail("Control data truncated");
+            if (n == 0) fail("Connection closed");
+
+            received += n;
+        }
+
+        return fds;
+    }
+
+    // Wire format of send_descriptors(): header, one flag byte per descriptor, payload.
+    struct handoff_header {
+        uint32_t size;
+        uint32_t count;
+    };
+
+    constexpr uint8_t handoff_accepted = 1;
+}
+
+namespace libsocket::unix {
+    descriptor socket() {
+        return libsocket::adopt(unix_stream());
     }
 
     void unlink(std::string path) {
@@ -48,7 +148,7 @@ namespace libsocket::unix {
     }
 
     void unlink(descriptor desc) {
-        std::unique_lock lock(socket_table_mutex);
+        std::unique_lock lock = libsocket::utils::lock_table();
 
         if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("close(unix): socket closed");
 
@@ -56,4 +156,197 @@ namespace libsocket::unix {
 
         if (sock.listen) ::unlink(sock.laddress.string().c_str());
     }
+
+    void send_descriptors(descriptor desc, std::vector<descriptor> descs, std::vector<int8_t> payload = {}) {
+        std::unique_lock lock = libsocket::utils::lock_table();
+
+        if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("send_descriptors(unix): socket closed");
+
+        libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+        if (sock.family != AF_UNIX) throw std::runtime_error("send_descriptors(unix): Not a UNIX socket");
+        if (descs.size() > libsocket::utils::unix::max_fds) throw std::runtime_error("send_descriptors(unix): Too many descriptors");
+        if (payload.size() > libsocket::utils::unix::max_payload) throw std::runtime_error("send_descriptors(unix): Payload too large");
+
+        libsocket::utils::unix::handoff_header header{static_cast<uint32_t>(payload.size()), static_cast<uint32_t>(descs.size())};
+
+        std::vector<int8_t> buffer(sizeof(header));
+        std::memcpy(buffer.data(), &header, sizeof(header));
+
+        // Duplicates keep the sent descriptors valid even if they are closed while sending.
+        std::vector<fd_t> fds;
+
+        for (descriptor& d : descs) {
+            if (!libsocket::utils::descriptor_ok(d)) {
+                for (fd_t fd : fds) ::close(fd);
+
+                throw std::runtime_error("send_descriptors(unix): socket closed");
+            }
+
+            libsocket::utils::socket& target = socket_table.at(d.id);
+            fd_t dup = ::fcntl(target.fd, F_DUPFD_CLOEXEC, 0);
+
+            if (dup == -1) {
+                std::string error = strerror(errno);
+
+                for (fd_t fd : fds) ::close(fd);
+
+                throw std::runtime_error("send_descriptors(unix): Unable to duplicate descriptor: " + error);
+            }
+
+            fds.push_back(dup);
+            buffer.push_back(target.accepted ? libsocket::utils::unix::handoff_accepted : 0);
+        }
+
+        buffer.insert(buffer.end(), payload.begin(), payload.end());
+
+        libsocket::utils::pin pin(sock);
+        lock.unlock();
+
+        std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.sendMtx);
+
+        try {
+            libsocket::utils::unix::send_fds(sock.fd, fds, buffer);
+        }
+
+        catch (const std::exception&) {
+            libsocket::utils::count_error(sock);
+
+            for (fd_t fd : fds) ::close(fd);
+
+            throw;
+        }
+
+        libsocket::utils::count_write(sock, buffer.size(), buffer.size());
+
+        for (fd_t fd : fds) ::close(fd);
+    }
+
+    // Received sockets are registered with their real family and type, without TLS.
+    descriptor_message recv_descriptors(descriptor desc) {
+        std::unique_lock lock = libsocket::utils::lock_table();
+
+        if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("recv_descriptors(unix): socket closed");
+
+        libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+        if (sock.family != AF_UNIX) throw std::runtime_error("recv_descriptors(unix): Not a UNIX socket");
+
+        libsocket::utils::pin pin(sock);
+        lock.unlock();
+
+        std::unique_lock sock_lock = libsocket::utils::lock_socket(desc, sock, sock.recvMtx);
+
+        libsocket::utils::unix::handoff_header header;
+        std::vector<int8_t> buffer(sizeof(header));
+
+        std::vector<fd_t> fds;
+
+        try {
+            fds = libsocket::utils::unix::recv_fds(sock.fd, buffer);
+            std::memcpy(&header, buffer.data(), sizeof(header));
+
+            if (header.count > libsocket::utils::unix::max_fds || header.size > libsocket::utils::unix::max_payload) throw std::runtime_error("recv_descriptors(unix): Malformed handoff header");
+
+            buffer.resize(header.count + header.size);
+
+            if (!buffer.empty()) {
+                std::vector<fd_t> extra = libsocket::utils::unix::recv_fds(sock.fd, buffer);
+
+                fds.insert(fds.end(), extra.begin(), extra.end());
+            }
+        }
+
+        catch (const std::exception&) {
+            libsocket::utils::count_error(sock);
+
+            for (fd_t fd : fds) ::close(fd);
+
+            throw;
+        }
+
+        libsocket::utils::count_read(sock, sizeof(header) + buffer.size());
+
+        // Registering the descriptors takes the table lock, never while holding recvMtx.
+        sock_lock.unlock();
+
+        if (fds.size() != header.count) {
+            for (fd_t fd : fds) ::close(fd);
+
+            throw std::runtime_error("recv_descriptors(unix): Descriptor count mismatch");
+        }
+
+        descriptor_message message;
+        message.data.assign(buffer.begin() + header.count, buffer.end());
+
+        for (size_t i = 0; i < fds.size(); i++) {
+            int32_t family = AF_UNSPEC;
+            int32_t type = 0;
+            int32_t listening = 0;
+            socklen_t size = sizeof(int32_t);
+
+            ::getsockopt(fds[i], SOL_SOCKET, SO_DOMAIN, &family, &size);
+            ::getsockopt(fds[i], SOL_SOCKET, SO_TYPE, &type, &size);
+            ::getsockopt(fds[i], SOL_SOCKET, SO_ACCEPTCONN, &listening, &size);
+
+            descriptor new_desc = libsocket::utils::emplace_socket(fds[i], family, type);
+
+            lock.lock();
+
+            libsocket::utils::socket& new_sock = socket_table.at(new_desc.id);
+
+            new_sock.working = true;
+            new_sock.listen = listening;
+            new_sock.accepted = buffer[i] & libsocket::utils::unix::handoff_accepted;
+            new_sock.blocking = !(::fcntl(fds[i], F_GETFL) & O_NONBLOCK);
+
+            try { new_sock.laddress = libsocket::utils::getsockname(new_desc); } catch (const std::exception&) {}
+            try { new_sock.raddress = libsocket::utils::getpeername(new_desc); } catch (const std::exception&) {}
+
+            lock.unlock();
+
+            message.descriptors.push_back(new_desc);
+        }
+
+        return message;
+    }
+
+    // Accepts one connection and hands it to the next worker in round-robin order; the local
+    // copy is closed afterwards. A failed send may leave a partial message on the channel, so
+    // that worker's channel is closed and removed from `workers`.
+    void dispatch(descriptor listener, std::vector<descriptor>& workers, size_t& next, std::vector<int8_t> payload = {}) {
+        if (workers.empty()) throw std::runtime_error("dispatch(unix): No workers");
+
+        descriptor client = libsocket::accept(listener);
+
+        while (!workers.empty()) {
+            size_t index = next++ % workers.size();
+            descriptor worker = workers[index];
+
+            try {
+                send_descriptors(worker, {client}, payload);
+                libsocket::close(client);
+
+                return;
+            }
+
+            catch (const std::exception&) {
+                try { libsocket::close(worker); } catch (const std::exception&) {}
+
+                workers.erase(workers.begin() + index);
+                next = index;
+            }
+        }
+
+        libsocket::close(client);
+
+        throw std::runtime_error("dispatch(unix): No worker accepted the connection");
+    }
+
+    // Throws once every worker channel has failed.
+    void balance(descriptor listener, std::vector<descriptor> workers) {
+        size_t next = 0;
+
+        while (true) dispatch(listener, workers, next);
+    }
 }
@@ -1,14 +1,30 @@
 #pragma once
 #include <random>
 #include <limits>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <atomic>
 #include <stdexcept>
+#include <cerrno>
+#include <cstring>
 
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "def.hpp"
 #include "socket.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 
 #undef unix
 
@@ -20,17 +36,223 @@ namespace libsocket {
         std::uniform_int_distribution<std::mt19937_64::result_type> random_s32(0, std::numeric_limits<int32_t>::max());
         std::uniform_int_distribution<std::mt19937_64::result_type> random_u64(0, std::numeric_limits<uint64_t>::max());
 
+        // Layers with per-descriptor state (shm::) release it here when close() is called
+        // without their own shutdown; run once no call is left on the socket.
+        std::vector<void (*)(int32_t)> close_hooks;
+
         bool descriptor_ok(descriptor desc) {
             auto it = socket_table.find(desc.id);
 
-            if (it != socket_table.end()) return desc.fingerprint == it->second.fingerprint;
+            if (it != socket_table.end()) return desc.fingerprint == it->second.fingerprint && !it->second.closing;
 
             return false;
         }
 
+        // Keeps a socket_table entry alive once the table lock is dropped: close() wakes
+        // pinned calls and waits for them to finish before it closes the fd and erases the
+        // entry. Create it under the table lock, after descriptor_ok().
+        // A negative timeout waits until woken.
+        void futex_wait(std::atomic<uint32_t>& word, uint32_t expected, int32_t timeout_ms = -1) {
+            timespec timeout{timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+
+            ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, timeout_ms < 0 ? nullptr : &timeout, nullptr, 0);
+        }
+
+        void futex_wake(std::atomic<uint32_t>& word) {
+            ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+        }
+
+        // Sockets the calling thread has pinned, so close() can refuse to wait on itself.
+        thread_local std::vector<const libsocket::utils::socket*> pinned;
+
+        struct pin {
+            libsocket::utils::socket& sock;
+
+            pin(libsocket::utils::socket& s) : sock(s) {
+                sock.users++;
+                pinned.push_back(&sock);
+            }
+
+            pin(const pin&) = delete;
+            pin& operator=(const pin&) = delete;
+
+            // The last call out wakes a close() waiting for the socket to drain.
+            ~pin() {
+                pinned.erase(std::find(pinned.rbegin(), pinned.rend(), &sock).base() - 1);
+
+                if (--sock.users == 0 && sock.closing) futex_wake(sock.users);
+            }
+        };
+
+        bool pinned_here(const libsocket::utils::socket& sock) {
+            return std::find(pinned.begin(), pinned.end(), &sock) != pinned.end();
+        }
+
+        // Per-socket counters (shared by both directions, hence the atomic add) and the
+        // thread's global shard. The member itself is compiled out with LIBSOCKET_NO_STATS.
+        void count([[maybe_unused]] libsocket::utils::socket& sock, [[maybe_unused]] libsocket::stats::field f, [[maybe_unused]] uint64_t value) {
+#ifndef LIBSOCKET_NO_STATS
+            libsocket::stats::add(sock.stats, f, value);
+#endif
+        }
+
+        // Counters of one direction, only updated under its recvMtx or sendMtx.
+        void count_owned([[maybe_unused]] libsocket::utils::socket& sock, [[maybe_unused]] libsocket::stats::field f, [[maybe_unused]] uint64_t value) {
+#ifndef LIBSOCKET_NO_STATS
+            libsocket::stats::add_owned(sock.stats, f, value);
+#endif
+        }
+
+        std::unique_lock<std::recursive_mutex> lock_table() {
+#if defined(LIBSOCKET_NO_STATS) && !defined(LIBSOCKET_TRACE)
+            return std::unique_lock(socket_table_mutex);
+#else
+            std::unique_lock lock(socket_table_mutex, std::try_to_lock);
+
+            if (!lock.owns_lock()) {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+                lock.lock();
+
+                libsocket::stats::add(&libsocket::stats::counters::table_waits, 1);
+                libsocket::stats::add(&libsocket::stats::counters::table_wait_ns, libsocket::stats::elapsed_ns(start));
+                libsocket::trace::span(libsocket::trace::event::table_lock, -1, start);
+            }
+
+            return lock;
+#endif
+        }
+
+        // I/O runs under the per-socket mutex, taken only after the table lock has been
+        // released: waiting on a socket mutex while holding the table would stall every
+        // libsocket call behind one blocked read. The entry must be pinned first.
+        std::unique_lock<std::recursive_mutex> lock_socket([[maybe_unused]] descriptor desc, [[maybe_unused]] libsocket::utils::socket& sock, std::recursive_mutex& mtx) {
+#if defined(LIBSOCKET_NO_STATS) && !defined(LIBSOCKET_TRACE)
+            return std::unique_lock(mtx);
+#else
+            std::unique_lock lock(mtx, std::try_to_lock);
+
+            if (!lock.owns_lock()) {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+                lock.lock();
+
+                libsocket::utils::count(sock, &libsocket::stats::counters::socket_waits, 1);
+                libsocket::utils::count(sock, &libsocket::stats::counters::socket_wait_ns, libsocket::stats::elapsed_ns(start));
+                libsocket::trace::span(libsocket::trace::event::socket_lock, desc.id, start);
+            }
+
+            return lock;
+#endif
+        }
+
+        void count_error(libsocket::utils::socket& sock) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) libsocket::utils::count(sock, &libsocket::stats::counters::eagain, 1);
+            else libsocket::utils::count(sock, &libsocket::stats::counters::errors, 1);
+        }
+
+        void count_read(libsocket::utils::socket& sock, int64_t result) {
+            libsocket::utils::count_owned(sock, &libsocket::stats::counters::read_calls, 1);
+
+            if (result >= 0) libsocket::utils::count_owned(sock, &libsocket::stats::counters::read_bytes, result);
+            else count_error(sock);
+        }
+
+        void count_write(libsocket::utils::socket& sock, int64_t result, int64_t size) {
+            libsocket::utils::count_owned(sock, &libsocket::stats::counters::write_calls, 1);
+
+            if (result >= 0) {
+                libsocket::utils::count_owned(sock, &libsocket::stats::counters::write_bytes, result);
+
+                if (result < size) libsocket::utils::count_owned(sock, &libsocket::stats::counters::short_writes, 1);
+            }
+
+            else count_error(sock);
+        }
+
+        // Low-latency receive: poll with MSG_DONTWAIT for the socket's spin budget before
+        // falling back to the blocking call, so a reply that arrives within the budget
+        // skips the sleep/wakeup round trip.
+        template<typename Recv>
+        int64_t spin_recv(libsocket::utils::socket& sock, int32_t flags, Recv recv) {
+            int64_t budget = sock.spin_ns.load(std::memory_order_relaxed);
+
+            if (budget > 0 && sock.blocking && !(flags & MSG_DONTWAIT)) {
+                std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds(budget);
+
+                do {
+                    int64_t received = recv(flags | MSG_DONTWAIT);
+
+                    if (received >= 0) {
+                        libsocket::utils::count(sock, &libsocket::stats::counters::spin_hits, 1);
+
+                        return received;
+                    }
+
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) return received;
+                } while (std::chrono::steady_clock::now() < deadline);
+
+                libsocket::utils::count(sock, &libsocket::stats::counters::spin_misses, 1);
+            }
+
+            return recv(flags);
+        }
+
+        // CPUs the process may run on (its affinity mask, not the machine's core count).
+        int32_t usable_cpus() {
+            cpu_set_t set;
+
+            if (::sched_getaffinity(0, sizeof(set), &set) == -1) return std::max<int32_t>(std::thread::hardware_concurrency(), 1);
+
+            return CPU_COUNT(&set);
+        }
+
+        int32_t sockaddr_size(int32_t family) {
+            if (family == AF_INET6) return sizeof(sockaddr_in6);
+            if (family == AF_UNIX) return sizeof(sockaddr_un);
+
+            return sizeof(sockaddr_in);
+        }
+
+        // UDP GSO limits: the kernel accepts at most 64 segments per send (UDP_MAX_SEGMENTS on
+        // older kernels) and the whole batch must fit one IPv4 UDP payload.
+        constexpr uint64_t gso_max_segments = 64;
+        constexpr int32_t gso_max_bytes = 65507;
+
+        descriptor emplace_socket(fd_t fd, int32_t family, int32_t type) {
+            std::unique_lock lock = lock_table();
+
+            int32_t id = random_s32(mersenne);
+            uint64_t fingerprint = random_u64(mersenne);
+
+            while (socket_table.count(id)) id = random_s32(mersenne);
+
+            libsocket::utils::socket& sock = socket_table.try_emplace(id).first->second;
+
+            sock.fd = fd;
+            sock.fingerprint = fingerprint;
+
+            sock.working = false;
+            sock.blocking = true;
+            sock.listen = false;
+            sock.accepted = false;
+            sock.gro = false;
+            sock.closing = false;
+
+            sock.users = 0;
+            sock.layer_epoch = 0;
+            sock.spin_ns = 0;
+
+            sock.family = family;
+            sock.type = type;
+            sock.sockaddr_size = sockaddr_size(family);
+
+            return {id, fingerprint};
+        }
+
         template<typename T>
         void setsockopt(descriptor desc, int32_t level, int32_t optname, T optval) {
-            std::unique_lock lock(socket_table_mutex);
+            std::unique_lock lock = libsocket::utils::lock_table();
 
             if (!descriptor_ok(desc)) throw std::runtime_error("setsockopt(): socket closed");
 
@@ -41,7 +263,7 @@ namespace libsocket {
 
         template<typename T>
         int32_t getsockopt(descriptor desc, int32_t level, int32_t optname, T& optval, socklen_t size = sizeof(T)) {
-            std::unique_lock lock(socket_table_mutex);
+            std::unique_lock lock = libsocket::utils::lock_table();
 
             if (!descriptor_ok(desc)) throw std::runtime_error("getsockopt(): socket closed");
 
@@ -52,15 +274,47 @@ namespace libsocket {
             return size;
         }
 
+        void set_blocking(descriptor desc, bool blocking) {
+            std::unique_lock lock = lock_table();
+
+            if (!descriptor_ok(desc)) throw std::runtime_error("set_blocking(): socket closed");
+
+            libsocket::utils::socket& sock = socket_table.at(desc.id);
+
+            int32_t flags = ::fcntl(sock.fd, F_GETFL);
+
+            if (flags == -1 || ::fcntl(sock.fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK) == -1) throw std::runtime_error("set_blocking(): Unable to set file status flags: " + std::string(strerror(errno)));
+
+            sock.blocking = blocking;
+        }
+
+        // Waits for `events` without holding any libsocket lock; returns the reported
+        // events, or 0 on timeout.
+        int16_t poll(descriptor desc, int16_t events, int32_t timeout_ms) {
+            std::unique_lock lock = lock_table();
+
+            if (!descriptor_ok(desc)) throw std::runtime_error("poll(): socket closed");
+
+            pollfd pfd{socket_table.at(desc.id).fd, events, 0};
+
+            lock.unlock();
+
+            int32_t status = ::poll(&pfd, 1, timeout_ms);
+
+            if (status == -1 && errno != EINTR) throw std::runtime_error("poll(): Unable to poll socket: " + std::string(strerror(errno)));
+
+            return status > 0 ? pfd.revents : 0;
+        }
+
         address getsockname(descriptor desc) {
-            std::unique_lock lock(socket_table_mutex);
+            std::unique_lock lock = libsocket::utils::lock_table();
 
             if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("getsockname(): socket closed");
 
             libsocket::utils::socket& sock = socket_table.at(desc.id);
 
-            sockaddr_storage my_addr;
-            socklen_t addrlen = sizeof(sockaddr_in);
+            sockaddr_storage my_addr{};
+            socklen_t addrlen = sizeof(my_addr);
 
             if (::getsockname(sock.fd, reinterpret_cast<sockaddr*>(&my_addr), &addrlen) == -1) throw std::runtime_error("getsockname(): Unable to get socket name: " + std::string(strerror(errno)));
 
@@ -68,18 +322,32 @@ namespace libsocket {
         }
 
         address getpeername(descriptor desc) {
-            std::unique_lock lock(socket_table_mutex);
+            std::unique_lock lock = libsocket::utils::lock_table();
 
             if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("getpeername(): socket closed");
 
             libsocket::utils::socket& sock = socket_table.at(desc.id);
 
-            sockaddr_storage my_addr;
-            socklen_t addrlen = sizeof(sockaddr_in);
+            sockaddr_storage my_addr{};
+            socklen_t addrlen = sizeof(my_addr);
 
             if (::getpeername(sock.fd, reinterpret_cast<sockaddr*>(&my_addr), &addrlen) == -1) throw std::runtime_error("getpeername(): Unable to get socket name: " + std::string(strerror(errno)));
 
             return address::from_sockaddr(my_addr);
         }
     }
-}
+
+    namespace stats {
+        snapshot_t snapshot(descriptor desc) {
+            std::unique_lock lock = libsocket::utils::lock_table();
+
+            if (!libsocket::utils::descriptor_ok(desc)) throw std::runtime_error("stats::snapshot(): socket closed");
+
+#ifndef LIBSOCKET_NO_STATS
+            return snapshot(socket_table.at(desc.id).stats);
+#else
+            return {};
+#endif
+        }
+    }
+}
\ No newline at end of file